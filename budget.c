@@ -0,0 +1,45 @@
+#include "budget.h"
+#include "utility.h"
+#include <time.h>
+#include <pthread.h>
+
+int budgetEnabled = 0;
+
+// Token bucket shared by every copying thread; it may go negative (debt), which the
+// thread that caused it sleeps off
+static double budgetRate = 0;    // Bytes per second
+static double budgetTokens = 0;  // Bytes that may be written without waiting
+static double budgetLastRefill = 0;
+static pthread_mutex_t budgetLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Function to limit the combined write rate of all copies (a rate of 0 or less disables it)
+void budgetInit(double bytesPerSecond) {
+    pthread_mutex_lock(&budgetLock);
+    budgetRate = bytesPerSecond;
+    budgetTokens = bytesPerSecond;
+    budgetLastRefill = monotonicSeconds();
+    budgetEnabled = bytesPerSecond > 0;
+    pthread_mutex_unlock(&budgetLock);
+}
+
+// Function to account for bytes about to be written, sleeping while over budget
+void budgetConsume(size_t bytes) {
+    pthread_mutex_lock(&budgetLock);
+    double now = monotonicSeconds();
+    budgetTokens += (now - budgetLastRefill) * budgetRate;
+    budgetLastRefill = now;
+    // Allow bursts of up to one second's worth
+    if (budgetTokens > budgetRate) {
+        budgetTokens = budgetRate;
+    }
+    budgetTokens -= bytes;
+    double wait = budgetTokens < 0 ? -budgetTokens / budgetRate : 0;
+    pthread_mutex_unlock(&budgetLock);
+
+    if (wait > 0) {
+        struct timespec delay;
+        delay.tv_sec = (time_t)wait;
+        delay.tv_nsec = (long)((wait - delay.tv_sec) * 1e9);
+        nanosleep(&delay, NULL);
+    }
+}
@@ -0,0 +1,16 @@
+#ifndef BUDGET_H
+#define BUDGET_H
+#include <stddef.h>
+
+// Non-zero once budgetInit() has set a limit. Checked inline by BUDGET_CONSUME so
+// that an unlimited run costs a single branch per chunk.
+extern int budgetEnabled;
+
+// Function prototypes
+void budgetInit(double bytesPerSecond);
+
+void budgetConsume(size_t bytes);
+
+#define BUDGET_CONSUME(bytes) do { if (budgetEnabled) {budgetConsume((bytes));} } while (0)
+
+#endif
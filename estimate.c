@@ -0,0 +1,423 @@
+#include "estimate.h"
+#include "fsio.h"
+#include "utility.h"
+#include "log.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+// Weight given to a new measurement when updating a stored rate
+#define RATE_SMOOTHING 0.3
+
+// Measured throughput of one device (0 when not measured yet)
+typedef struct {
+    unsigned long long device;
+    double filesPerSecond;
+    double bytesPerSecond;
+} DeviceRate;
+
+typedef struct {
+    DeviceRate* rates;
+    int numRates;
+} RateTable;
+
+// Serialises updates of the rates file between jobs of this process
+static pthread_mutex_t ratesLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Helper function to get the rates file: $MYSYNC_RATES, else ~/.mysync_rates (NULL if neither)
+static char* ratesPath() {
+    const char* path = getenv("MYSYNC_RATES");
+    if (path != NULL && *path != '\0') {
+        return strdup(path);
+    }
+
+    const char* home = getenv("HOME");
+    if (home == NULL || *home == '\0') {
+        return NULL;
+    }
+    return fsioJoinPath(home, ".mysync_rates");
+}
+
+// Helper function to find a device's rates, adding an empty entry if asked to
+static DeviceRate* findRate(RateTable* table, unsigned long long device, int add) {
+    for (int i = 0; i < table->numRates; i++) {
+        if (table->rates[i].device == device) {
+            return &table->rates[i];
+        }
+    }
+    if (!add) {
+        return NULL;
+    }
+
+    DeviceRate* temp = (DeviceRate*)realloc(table->rates, (table->numRates + 1) * sizeof(DeviceRate));
+    if (temp == NULL) {
+        logErrno("Memory allocation error");
+        return NULL;
+    }
+    table->rates = temp;
+    DeviceRate* rate = &table->rates[table->numRates++];
+    rate->device = device;
+    rate->filesPerSecond = 0;
+    rate->bytesPerSecond = 0;
+    return rate;
+}
+
+// Helper function to read the rates file (a missing file gives an empty table)
+static void loadRates(RateTable* table) {
+    table->rates = NULL;
+    table->numRates = 0;
+
+    char* path = ratesPath();
+    FILE* file = path ? fopen(path, "r") : NULL;
+    free(path);
+    if (file == NULL) {
+        return;
+    }
+
+    char line[256];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        unsigned long long device;
+        double filesPerSecond, bytesPerSecond;
+        if (line[0] == '#' || sscanf(line, "%llu %lf %lf", &device, &filesPerSecond, &bytesPerSecond) != 3) {
+            continue;
+        }
+
+        DeviceRate* rate = findRate(table, device, 1);
+        if (rate != NULL) {
+            rate->filesPerSecond = filesPerSecond;
+            rate->bytesPerSecond = bytesPerSecond;
+        }
+    }
+    fclose(file);
+}
+
+// Helper function to replace the rates file with the table (written aside, then renamed)
+static int saveRates(const RateTable* table) {
+    char* path = ratesPath();
+    if (path == NULL) {
+        return 1;
+    }
+
+    size_t size = strlen(path) + 32;
+    char* temporaryPath = (char*)malloc(size);
+    if (temporaryPath == NULL) {
+        logErrno("Memory allocation error");
+        free(path);
+        return 1;
+    }
+    snprintf(temporaryPath, size, "%s.%ld", path, (long)getpid());
+
+    int result = 1;
+    FILE* file = fopen(temporaryPath, "w");
+    if (file == NULL) {
+        logErrno("Error writing rates file");
+    } else {
+        fprintf(file, "# mysync measured rates: device files/s bytes/s\n");
+        for (int i = 0; i < table->numRates; i++) {
+            fprintf(file, "%llu %.3f %.3f\n", table->rates[i].device,
+                    table->rates[i].filesPerSecond, table->rates[i].bytesPerSecond);
+        }
+        if (fclose(file) == 0 && rename(temporaryPath, path) == 0) {
+            result = 0;
+        } else {
+            logErrno("Error writing rates file");
+            unlink(temporaryPath);
+        }
+    }
+
+    free(temporaryPath);
+    free(path);
+    return result;
+}
+
+// One copy as the executor sees it: its devices and its source (copies of the same source
+// are made together, reading it once)
+typedef struct {
+    dev_t sourceDevice;
+    dev_t destinationDevice;
+    const char* sourcePath;
+    double seconds;
+} QueuedCopy;
+
+// Time the copies of a plan keep one device busy
+typedef struct {
+    dev_t device;
+    double total;
+    double longest;
+} DeviceLoad;
+
+// Helper function to order copies by source
+static int compareQueuedCopies(const void* a, const void* b) {
+    const QueuedCopy* x = (const QueuedCopy*)a;
+    const QueuedCopy* y = (const QueuedCopy*)b;
+    return strcmp(x->sourcePath, y->sourcePath);
+}
+
+// Helper function to add a copy's time to a device's load
+static void addDeviceLoad(DeviceLoad* loads, int* numLoads, dev_t device, double seconds) {
+    int i = 0;
+    while (i < *numLoads && loads[i].device != device) {
+        i++;
+    }
+    if (i == *numLoads) {
+        loads[i].device = device;
+        loads[i].total = 0;
+        loads[i].longest = 0;
+        (*numLoads)++;
+    }
+    loads[i].total += seconds;
+    if (seconds > loads[i].longest) {loads[i].longest = seconds;}
+}
+
+// Helper function to predict how long the busiest device of the plan will take
+static double estimateQueueSeconds(const SyncPlan* plan, ProgramOptions opts, RateTable* table) {
+    if (plan->numOperations <= 0) {
+        return 0;
+    }
+    QueuedCopy* copies = (QueuedCopy*)malloc((size_t)plan->numOperations * sizeof(QueuedCopy));
+    DeviceLoad* loads = (DeviceLoad*)malloc((size_t)plan->numOperations * 2 * sizeof(DeviceLoad));
+    if (copies == NULL || loads == NULL) {
+        logErrno("Memory allocation error");
+        free(copies);
+        free(loads);
+        return 0;
+    }
+
+    char* lastDirectory = NULL;
+    dev_t lastDevice = 0;
+    int numCopies = 0;
+    for (int i = 0; i < plan->numOperations; i++) {
+        const CopyOperation* operation = &plan->operations[i];
+        if (operation->linkSource != NULL) {
+            continue;
+        }
+
+        QueuedCopy* copy = &copies[numCopies++];
+        copy->sourceDevice = operation->device;
+        copy->destinationDevice = planDestinationDevice(operation->destinationPath, &lastDirectory, &lastDevice);
+        copy->sourcePath = operation->sourcePath;
+
+        DeviceRate* rate = findRate(table, copy->destinationDevice, 0);
+        if (operation->size < ESTIMATE_SMALL_FILE) {
+            copy->seconds = 1 / (rate != NULL && rate->filesPerSecond > 0 ? rate->filesPerSecond : ESTIMATE_DEFAULT_FILES_PER_SECOND);
+        } else {
+            copy->seconds = operation->size / (rate != NULL && rate->bytesPerSecond > 0 ? rate->bytesPerSecond : ESTIMATE_DEFAULT_BYTES_PER_SECOND);
+        }
+    }
+    free(lastDirectory);
+    qsort(copies, numCopies, sizeof(QueuedCopy), compareQueuedCopies);
+
+    // Each destination device is busy for its own copies, the source device for as long
+    // as the slowest destination of each source it is read for
+    int numLoads = 0;
+    for (int start = 0, end; start < numCopies; start = end) {
+        double longest = 0;
+        for (end = start; end < numCopies && strcmp(copies[end].sourcePath, copies[start].sourcePath) == 0; end++) {
+            addDeviceLoad(loads, &numLoads, copies[end].destinationDevice, copies[end].seconds);
+            if (copies[end].seconds > longest) {longest = copies[end].seconds;}
+        }
+        if (copies[start].sourceDevice != copies[start].destinationDevice || end - start > 1) {
+            addDeviceLoad(loads, &numLoads, copies[start].sourceDevice, longest);
+        }
+    }
+
+    // A device can't finish before its longest copy, however many run at a time
+    int concurrency = opts.deviceConcurrency > 0 ? opts.deviceConcurrency : 1;
+    double slowest = 0;
+    for (int i = 0; i < numLoads; i++) {
+        double seconds = loads[i].total / concurrency > loads[i].longest ? loads[i].total / concurrency : loads[i].longest;
+        if (seconds > slowest) {slowest = seconds;}
+    }
+
+    free(copies);
+    free(loads);
+    return slowest;
+}
+
+// Function to total the plan's work per destination root and predict how long it will
+// take from the rates measured on earlier runs (or defaults for unmeasured devices)
+int estimateSyncPlan(const SyncPlan* plan, ProgramOptions opts, SyncEstimate* estimate) {
+    memset(estimate, 0, sizeof(SyncEstimate));
+    estimate->roots = (RootEstimate*)calloc(opts.numDirectories, sizeof(RootEstimate));
+    if (estimate->roots == NULL) {
+        logErrno("Memory allocation error");
+        return 1;
+    }
+    estimate->numRoots = opts.numDirectories;
+
+    // Work that is timed per file, and bytes of larger files, for each root
+    int* numSmall = (int*)calloc(opts.numDirectories, sizeof(int));
+    long long* largeBytes = (long long*)calloc(opts.numDirectories, sizeof(long long));
+    if (numSmall == NULL || largeBytes == NULL) {
+        logErrno("Memory allocation error");
+        free(numSmall);
+        free(largeBytes);
+        freeSyncEstimate(estimate);
+        return 1;
+    }
+
+    for (int i = 0; i < plan->numOperations; i++) {
+        const CopyOperation* operation = &plan->operations[i];
+        int root = findPathRoot(operation->destinationPath, opts.directories, opts.numDirectories);
+        if (root == -1) {
+            continue;
+        }
+
+        RootEstimate* rootEstimate = &estimate->roots[root];
+        if (operation->linkSource != NULL) {
+            rootEstimate->numLinks++;
+            continue;
+        }
+        if (operation->isUpdate) {
+            rootEstimate->numUpdates++;
+        } else {
+            rootEstimate->numCreates++;
+        }
+        rootEstimate->bytes += operation->size;
+        if (operation->size < ESTIMATE_SMALL_FILE) {
+            numSmall[root]++;
+        } else {
+            largeBytes[root] += operation->size;
+        }
+    }
+
+    for (int i = 0; i < plan->numDirectories; i++) {
+        int root = findPathRoot(plan->directories[i], opts.directories, opts.numDirectories);
+        if (root != -1) {
+            estimate->roots[root].numMkdirs++;
+            numSmall[root]++;
+        }
+    }
+
+    RateTable table;
+    pthread_mutex_lock(&ratesLock);
+    loadRates(&table);
+    pthread_mutex_unlock(&ratesLock);
+
+    for (int i = 0; i < estimate->numRoots; i++) {
+        RootEstimate* rootEstimate = &estimate->roots[i];
+        rootEstimate->root = opts.directories[i];
+
+        struct stat info;
+        rootEstimate->device = fsioStat(rootEstimate->root, &info) == 0 ? info.st_dev : 0;
+        DeviceRate* rate = findRate(&table, rootEstimate->device, 0);
+
+        double filesPerSecond = ESTIMATE_DEFAULT_FILES_PER_SECOND;
+        double bytesPerSecond = ESTIMATE_DEFAULT_BYTES_PER_SECOND;
+        if (rate != NULL && rate->filesPerSecond > 0) {filesPerSecond = rate->filesPerSecond;}
+        if (rate != NULL && rate->bytesPerSecond > 0) {bytesPerSecond = rate->bytesPerSecond;}
+        rootEstimate->measured = rate != NULL;
+
+        rootEstimate->seconds = numSmall[i] / filesPerSecond + largeBytes[i] / bytesPerSecond;
+        estimate->numOperations += rootEstimate->numCreates + rootEstimate->numUpdates
+                                 + rootEstimate->numLinks + rootEstimate->numMkdirs;
+        estimate->bytes += rootEstimate->bytes;
+    }
+
+    // Model the executor: no device is used by more than opts.deviceConcurrency copies at a
+    // time, and devices work in parallel, so the busiest device decides the total.
+    // Directories are made before the copies.
+    for (int i = 0; i < estimate->numRoots; i++) {
+        const RootEstimate* rootEstimate = &estimate->roots[i];
+        DeviceRate* rate = findRate(&table, rootEstimate->device, 0);
+        double filesPerSecond = rate != NULL && rate->filesPerSecond > 0 ? rate->filesPerSecond : ESTIMATE_DEFAULT_FILES_PER_SECOND;
+        estimate->seconds += rootEstimate->numMkdirs / filesPerSecond;
+    }
+    estimate->seconds += estimateQueueSeconds(plan, opts, &table);
+
+    free(table.rates);
+    free(numSmall);
+    free(largeBytes);
+    return 0;
+}
+
+// Function to print the estimate for every root with work to do, then the totals
+void printSyncEstimate(const SyncEstimate* estimate) {
+    for (int i = 0; i < estimate->numRoots; i++) {
+        const RootEstimate* root = &estimate->roots[i];
+        if (root->numCreates + root->numUpdates + root->numLinks + root->numMkdirs == 0) {
+            continue;
+        }
+        logResult("Estimate for %s: %d creates, %d updates, %d links, %d mkdirs, %.1f MiB, %.2f s%s\n",
+                  root->root, root->numCreates, root->numUpdates, root->numLinks, root->numMkdirs,
+                  root->bytes / 1048576.0, root->seconds, root->measured ? "" : " (default rates)");
+    }
+    logResult("Estimate: %d operations, %.1f MiB, %.2f s\n",
+              estimate->numOperations, estimate->bytes / 1048576.0, estimate->seconds);
+}
+
+void freeSyncEstimate(SyncEstimate* estimate) {
+    free(estimate->roots);
+    estimate->roots = NULL;
+    estimate->numRoots = 0;
+}
+
+// Function to update the stored rates of each destination device from an executed plan
+int recordSyncRates(const SyncPlan* plan, ProgramOptions opts) {
+    if (plan->numOperations == 0) {
+        return 0;
+    }
+
+    // Per root: files and time below ESTIMATE_SMALL_FILE, bytes and time above
+    typedef struct {
+        int numSmall;
+        double smallSeconds;
+        long long largeBytes;
+        double largeSeconds;
+    } RootSample;
+    RootSample* samples = (RootSample*)calloc(opts.numDirectories, sizeof(RootSample));
+    if (samples == NULL) {
+        logErrno("Memory allocation error");
+        return 1;
+    }
+
+    for (int i = 0; i < plan->numOperations; i++) {
+        const CopyOperation* operation = &plan->operations[i];
+        int root = findPathRoot(operation->destinationPath, opts.directories, opts.numDirectories);
+        if (root == -1 || operation->result != 0 || operation->linkSource != NULL) {
+            continue;
+        }
+        if (operation->size < ESTIMATE_SMALL_FILE) {
+            samples[root].numSmall++;
+            samples[root].smallSeconds += operation->seconds;
+        } else {
+            samples[root].largeBytes += operation->size;
+            samples[root].largeSeconds += operation->seconds;
+        }
+    }
+
+    pthread_mutex_lock(&ratesLock);
+    RateTable table;
+    loadRates(&table);
+    for (int i = 0; i < opts.numDirectories; i++) {
+        RootSample* sample = &samples[i];
+        struct stat info;
+        if ((sample->numSmall == 0 && sample->largeBytes == 0) || fsioStat(opts.directories[i], &info) != 0) {
+            continue;
+        }
+
+        DeviceRate* rate = findRate(&table, info.st_dev, 1);
+        if (rate == NULL) {
+            continue;
+        }
+        if (sample->numSmall > 0 && sample->smallSeconds > 0) {
+            double measured = sample->numSmall / sample->smallSeconds;
+            rate->filesPerSecond = rate->filesPerSecond > 0
+                ? (1 - RATE_SMOOTHING) * rate->filesPerSecond + RATE_SMOOTHING * measured : measured;
+        }
+        if (sample->largeBytes > 0 && sample->largeSeconds > 0) {
+            double measured = sample->largeBytes / sample->largeSeconds;
+            rate->bytesPerSecond = rate->bytesPerSecond > 0
+                ? (1 - RATE_SMOOTHING) * rate->bytesPerSecond + RATE_SMOOTHING * measured : measured;
+        }
+    }
+    int result = saveRates(&table);
+    pthread_mutex_unlock(&ratesLock);
+
+    free(table.rates);
+    free(samples);
+    return result;
+}
@@ -0,0 +1,44 @@
+#ifndef ESTIMATE_H
+#define ESTIMATE_H
+#include "options.h"
+#include "plan.h"
+#include <sys/types.h>
+
+// Files below this size are timed per file, larger ones per byte
+#define ESTIMATE_SMALL_FILE (1024 * 1024)
+
+// Rates assumed for a device with no measurements yet
+#define ESTIMATE_DEFAULT_FILES_PER_SECOND 500.0
+#define ESTIMATE_DEFAULT_BYTES_PER_SECOND (100.0 * 1024 * 1024)
+
+// Planned work and predicted duration for one destination root
+typedef struct {
+    const char* root;
+    dev_t device;
+    int numCreates;
+    int numUpdates;
+    int numLinks;
+    int numMkdirs;
+    long long bytes;
+    double seconds;
+    int measured; // Rates came from earlier runs (not the defaults)
+} RootEstimate;
+
+typedef struct {
+    RootEstimate* roots;
+    int numRoots;
+    int numOperations;
+    long long bytes;
+    double seconds;
+} SyncEstimate;
+
+// Function prototypes
+int estimateSyncPlan(const SyncPlan* plan, ProgramOptions opts, SyncEstimate* estimate);
+
+void printSyncEstimate(const SyncEstimate* estimate);
+
+void freeSyncEstimate(SyncEstimate* estimate);
+
+int recordSyncRates(const SyncPlan* plan, ProgramOptions opts);
+
+#endif
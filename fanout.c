@@ -0,0 +1,465 @@
+#include "fanout.h"
+#include "log.h"
+#include "utility.h"
+#include "resume.h"
+#include "fsio.h"
+#include "trace.h"
+#include "budget.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+typedef struct {
+    char* data;
+    ssize_t length;
+    long sequence;   // Chunk number currently held (-1 when never filled)
+    int pending;     // Writers that still have to write this chunk
+} FanOutSlot;
+
+typedef struct FanOutWriter FanOutWriter;
+
+typedef struct {
+    FanOutSlot slots[FANOUT_SLOTS];
+    long numChunks;  // Total chunks, known once the reader hits end of file (-1 until then)
+    long numRead;    // Chunks read so far
+    int readFailed;
+    int sourceFile;  // Also read by detached writers (with pread)
+    FanOutWriter** writers;
+    int numWriters;
+    int numAttached; // Writers still taking their chunks from the slots
+    pthread_mutex_t lock;
+    pthread_cond_t filled;  // A slot has new data (or the read finished)
+    pthread_cond_t drained; // A slot has been written by every writer
+} FanOutRing;
+
+// A writer thread, kept for the life of its workspace. It writes one destination per task.
+struct FanOutWriter {
+    FanOutWorkspace* workspace;
+    pthread_t thread;
+    int busy;        // A task is assigned and not finished yet
+    FanOutRing* ring;
+    const char* destinationPath;
+    int fd;
+    int result;
+    const struct stat* sourceInfo;
+    int preserveMetadata;
+    long position;   // Chunk being written or waited for
+    int writing;     // The chunk at position is being written from its slot
+    int detached;    // Fell behind: reads the rest of the source itself
+    char* buffer;    // Used once detached (allocated on first use)
+};
+
+struct FanOutWorkspace {
+    char* buffers[FANOUT_SLOTS]; // Allocated on first use
+    FanOutWriter** writers;
+    int numWriters;
+    int stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t assigned;     // Writers have new tasks (or must stop)
+    pthread_cond_t finished;     // A writer finished its task
+};
+
+// Helper function to write the rest of the source to a detached destination, reading it
+// from offset into the writer's own buffer
+static void fanOutWriteAlone(FanOutWriter* writer, off_t offset) {
+    if (writer->buffer == NULL) {
+        writer->buffer = (char*)malloc(FANOUT_CHUNK_SIZE);
+        if (writer->buffer == NULL) {
+            logErrno("Memory allocation error");
+            writer->result = 1;
+            return;
+        }
+    }
+
+    while (writer->result == 0) {
+        ssize_t bytesRead = pread(writer->ring->sourceFile, writer->buffer, FANOUT_CHUNK_SIZE, offset);
+        if (bytesRead == -1) {
+            logErrno("Error reading source file");
+            writer->result = 1;
+        }
+        if (bytesRead <= 0) {
+            break;
+        }
+        BUDGET_CONSUME((size_t)bytesRead);
+
+        for (ssize_t written = 0; writer->result == 0 && written < bytesRead; ) {
+            ssize_t bytesWritten = pwrite(writer->fd, writer->buffer + written, bytesRead - written, offset + written);
+            if (bytesWritten == -1) {
+                logErrno("Error writing to destination file");
+                writer->result = 1;
+            } else {
+                written += bytesWritten;
+            }
+        }
+        offset += bytesRead;
+    }
+}
+
+// Helper function to write every chunk to one destination, in order
+static void fanOutWrite(FanOutWriter* writer) {
+    FanOutRing* ring = writer->ring;
+    off_t offset = 0;
+    int detached = 0;
+
+    TRACE_BEGIN("copy", writer->destinationPath);
+    for (long sequence = 0; ; sequence++) {
+        FanOutSlot* slot = &ring->slots[sequence % FANOUT_SLOTS];
+
+        pthread_mutex_lock(&ring->lock);
+        writer->position = sequence;
+        while (!writer->detached && slot->sequence != sequence && (ring->numChunks == -1 || sequence < ring->numChunks)) {
+            pthread_cond_wait(&ring->filled, &ring->lock);
+        }
+        detached = writer->detached;
+        int done = detached || slot->sequence != sequence;
+        writer->writing = !done;
+        pthread_mutex_unlock(&ring->lock);
+        if (done) {
+            break;
+        }
+
+        // The slot can't be refilled until this writer releases it, so write without the lock.
+        // After a failure keep releasing slots so the other destinations aren't held up.
+        for (ssize_t written = 0; writer->result == 0 && written < slot->length; ) {
+            ssize_t bytesWritten = pwrite(writer->fd, slot->data + written, slot->length - written, offset + written);
+            if (bytesWritten == -1) {
+                logErrno("Error writing to destination file");
+                writer->result = 1;
+            } else {
+                written += bytesWritten;
+            }
+        }
+        offset += slot->length;
+
+        pthread_mutex_lock(&ring->lock);
+        writer->writing = 0;
+        if (--slot->pending == 0) {
+            pthread_cond_signal(&ring->drained);
+        }
+        pthread_mutex_unlock(&ring->lock);
+    }
+    if (detached) {
+        fanOutWriteAlone(writer, offset);
+    }
+    TRACE_END("copy", writer->destinationPath);
+
+    if (!detached && ring->readFailed) {
+        writer->result = 1;
+    }
+    if (writer->result == 0 && writer->preserveMetadata) {
+        writer->result = applyMetadata(writer->fd, writer->sourceInfo, writer->destinationPath);
+    } else if (writer->result == 0) {
+        writer->result = applyModificationTime(writer->fd, writer->sourceInfo);
+    }
+}
+
+// Helper function run by each writer thread: perform tasks until the workspace is freed
+static void* fanOutWriterMain(void* arg) {
+    FanOutWriter* writer = (FanOutWriter*)arg;
+    FanOutWorkspace* workspace = writer->workspace;
+
+    pthread_mutex_lock(&workspace->lock);
+    while (1) {
+        while (!writer->busy && !workspace->stopping) {
+            pthread_cond_wait(&workspace->assigned, &workspace->lock);
+        }
+        if (!writer->busy) {
+            break;
+        }
+        pthread_mutex_unlock(&workspace->lock);
+
+        fanOutWrite(writer);
+
+        pthread_mutex_lock(&workspace->lock);
+        writer->busy = 0;
+        pthread_cond_broadcast(&workspace->finished);
+    }
+    pthread_mutex_unlock(&workspace->lock);
+    return NULL;
+}
+
+// Function to create a workspace for copyFileFanOut: its buffers and writer threads are
+// kept between copies, so copying file after file doesn't start threads for each one
+FanOutWorkspace* createFanOutWorkspace() {
+    FanOutWorkspace* workspace = (FanOutWorkspace*)calloc(1, sizeof(FanOutWorkspace));
+    if (workspace == NULL) {
+        logErrno("Memory allocation error");
+        return NULL;
+    }
+
+    pthread_mutex_init(&workspace->lock, NULL);
+    pthread_cond_init(&workspace->assigned, NULL);
+    pthread_cond_init(&workspace->finished, NULL);
+    return workspace;
+}
+
+// Function to stop a workspace's writers and free it
+void freeFanOutWorkspace(FanOutWorkspace* workspace) {
+    if (workspace == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&workspace->lock);
+    workspace->stopping = 1;
+    pthread_cond_broadcast(&workspace->assigned);
+    pthread_mutex_unlock(&workspace->lock);
+    for (int i = 0; i < workspace->numWriters; i++) {
+        pthread_join(workspace->writers[i]->thread, NULL);
+        free(workspace->writers[i]->buffer);
+        free(workspace->writers[i]);
+    }
+    free(workspace->writers);
+
+    for (int i = 0; i < FANOUT_SLOTS; i++) {
+        free(workspace->buffers[i]);
+    }
+    pthread_cond_destroy(&workspace->finished);
+    pthread_cond_destroy(&workspace->assigned);
+    pthread_mutex_destroy(&workspace->lock);
+    free(workspace);
+}
+
+// Helper function to make sure the workspace has buffers and count writers (0 on success)
+static int fanOutPrepare(FanOutWorkspace* workspace, int count) {
+    for (int i = 0; i < FANOUT_SLOTS; i++) {
+        if (workspace->buffers[i] == NULL) {
+            workspace->buffers[i] = (char*)malloc(FANOUT_CHUNK_SIZE);
+            if (workspace->buffers[i] == NULL) {
+                logErrno("Memory allocation error");
+                return 1;
+            }
+        }
+    }
+
+    if (workspace->numWriters >= count) {
+        return 0;
+    }
+    FanOutWriter** temp = (FanOutWriter**)realloc(workspace->writers, count * sizeof(FanOutWriter*));
+    if (temp == NULL) {
+        logErrno("Memory allocation error");
+        return 1;
+    }
+    workspace->writers = temp;
+
+    while (workspace->numWriters < count) {
+        FanOutWriter* writer = (FanOutWriter*)calloc(1, sizeof(FanOutWriter));
+        if (writer == NULL) {
+            logErrno("Memory allocation error");
+            return 1;
+        }
+        writer->workspace = workspace;
+        if (pthread_create(&writer->thread, NULL, fanOutWriterMain, writer) != 0) {
+            free(writer);
+            return 1;
+        }
+        workspace->writers[workspace->numWriters++] = writer;
+    }
+    return 0;
+}
+
+// Helper function to detach the writers that still hold the chunk the reader must refill
+// next, when others have already written it and wait for more (ring lock held). They
+// finish by reading the source themselves, so one slow destination doesn't hold up the rest.
+static void fanOutDetachLagging(FanOutRing* ring, long heldSequence) {
+    int waiting = 0;
+    for (int w = 0; w < ring->numWriters; w++) {
+        waiting |= !ring->writers[w]->detached && ring->writers[w]->position > heldSequence;
+    }
+    if (!waiting) {
+        return; // Every destination is behind, the reader isn't what they wait for
+    }
+
+    for (int w = 0; w < ring->numWriters; w++) {
+        FanOutWriter* writer = ring->writers[w];
+        if (writer->detached || writer->position > heldSequence) {
+            continue;
+        }
+        writer->detached = 1;
+        ring->numAttached--;
+        // Release the chunks it won't take from the slots (one being written is released
+        // by the writer when it is done)
+        for (long sequence = writer->position + writer->writing; sequence < ring->numRead; sequence++) {
+            ring->slots[sequence % FANOUT_SLOTS].pending--;
+        }
+        logMessage(LOG_LEVEL_VERBOSE, "%s fell behind, reading its source separately\n", writer->destinationPath);
+    }
+    pthread_cond_broadcast(&ring->filled);
+}
+
+// Helper function to copy to each destination on its own, reading the source each time
+static int copyFileSerially(const char* sourcePath, char** destinationPaths, int numDestinations,
+                            ProgramOptions opts, int* results) {
+    int failures = 0;
+    for (int i = 0; i < numDestinations; i++) {
+        if (opts.optionP) {
+            results[i] = copyFileWithMetadata(sourcePath, destinationPaths[i], opts);
+        } else {
+            results[i] = copyFileWithoutMetadata(sourcePath, destinationPaths[i], opts);
+        }
+        failures += results[i] != 0;
+    }
+    return failures;
+}
+
+// Function to copy one source to several destinations, reading it only once. Each chunk
+// is read into a shared buffer and written to every destination concurrently, by the
+// workspace's writer threads. results[i] is set to 0 for every destination written
+// successfully. Returns the number of failures. A workspace must only be used by one
+// copy at a time; with none, a temporary one is made for this copy.
+int copyFileFanOut(const char* sourcePath, char** destinationPaths, int numDestinations,
+                   ProgramOptions opts, int* results, FanOutWorkspace* workspace) {
+    for (int i = 0; i < numDestinations; i++) {
+        results[i] = 1;
+    }
+
+    int sourceFile = fsioOpen(sourcePath, O_RDONLY, 0);
+    struct stat sourceInfo;
+    if (sourceFile == -1 || fstat(sourceFile, &sourceInfo) == -1) {
+        logErrno("Error opening source file");
+        if (sourceFile != -1) {close(sourceFile);}
+        return numDestinations;
+    }
+
+    // A single destination or a file within one chunk (served from the page cache when
+    // read again) gains nothing, and resumable copies keep per-destination checkpoints
+    if (numDestinations == 1 || sourceInfo.st_size < FANOUT_CHUNK_SIZE
+        || (opts.optionC && sourceInfo.st_size >= RESUME_MIN_SIZE)) {
+        close(sourceFile);
+        return copyFileSerially(sourcePath, destinationPaths, numDestinations, opts, results);
+    }
+
+    FanOutWorkspace* temporary = NULL;
+    if (workspace == NULL) {
+        workspace = temporary = createFanOutWorkspace();
+    }
+    if (workspace == NULL || fanOutPrepare(workspace, numDestinations) != 0) {
+        logMessage(LOG_LEVEL_WARN, "Could not start writers for %s, copying to each destination in turn\n", sourcePath);
+        freeFanOutWorkspace(temporary);
+        close(sourceFile);
+        return copyFileSerially(sourcePath, destinationPaths, numDestinations, opts, results);
+    }
+
+    FanOutRing ring;
+    ring.numChunks = -1;
+    ring.numRead = 0;
+    ring.readFailed = 0;
+    ring.sourceFile = sourceFile;
+    ring.writers = workspace->writers;
+    pthread_mutex_init(&ring.lock, NULL);
+    pthread_cond_init(&ring.filled, NULL);
+    pthread_cond_init(&ring.drained, NULL);
+    for (int i = 0; i < FANOUT_SLOTS; i++) {
+        ring.slots[i].data = workspace->buffers[i];
+        ring.slots[i].sequence = -1;
+        ring.slots[i].pending = 0;
+    }
+
+    // Hand each destination that could be opened to a writer
+    int numWriters = 0;
+    pthread_mutex_lock(&workspace->lock);
+    for (int i = 0; i < numDestinations; i++) {
+        // Create or open the destination file for writing
+        int fd = openDestinationFile(destinationPaths[i]);
+        if (fd == -1) {
+            logErrno("Error opening destination file");
+            continue;
+        }
+
+        FanOutWriter* writer = workspace->writers[numWriters++];
+        writer->ring = &ring;
+        writer->destinationPath = destinationPaths[i];
+        writer->fd = fd;
+        writer->result = 0;
+        writer->sourceInfo = &sourceInfo;
+        writer->preserveMetadata = opts.optionP;
+        writer->position = 0;
+        writer->writing = 0;
+        writer->detached = 0;
+        writer->busy = 1;
+    }
+    ring.numWriters = numWriters;
+    ring.numAttached = numWriters;
+    pthread_cond_broadcast(&workspace->assigned);
+    pthread_mutex_unlock(&workspace->lock);
+
+    // Read each chunk once, into a slot every writer has finished with. Only the reader
+    // changes numAttached, so it reads it without the lock.
+    TRACE_BEGIN("read", sourcePath);
+    for (long sequence = 0; ring.numAttached > 0; sequence++) {
+        FanOutSlot* slot = &ring.slots[sequence % FANOUT_SLOTS];
+
+        pthread_mutex_lock(&ring.lock);
+        while (slot->pending > 0) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += FANOUT_LAG_NS;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            if (pthread_cond_timedwait(&ring.drained, &ring.lock, &deadline) == ETIMEDOUT) {
+                fanOutDetachLagging(&ring, slot->sequence);
+            }
+        }
+        pthread_mutex_unlock(&ring.lock);
+
+        ssize_t bytesRead = read(sourceFile, slot->data, FANOUT_CHUNK_SIZE);
+        if (bytesRead > 0) {
+            // Every attached destination writes the chunk, so all of them count against the budget
+            BUDGET_CONSUME((size_t)bytesRead * ring.numAttached);
+        }
+
+        pthread_mutex_lock(&ring.lock);
+        if (bytesRead <= 0) {
+            if (bytesRead == -1) {
+                logErrno("Error reading source file");
+                ring.readFailed = 1;
+            }
+            ring.numChunks = sequence;
+            pthread_cond_broadcast(&ring.filled);
+            pthread_mutex_unlock(&ring.lock);
+            break;
+        }
+        slot->length = bytesRead;
+        slot->sequence = sequence;
+        slot->pending = ring.numAttached;
+        ring.numRead = sequence + 1;
+        pthread_cond_broadcast(&ring.filled);
+        pthread_mutex_unlock(&ring.lock);
+    }
+    TRACE_END("read", sourcePath);
+
+    // Wait for the writers, then collect the results in destination order
+    pthread_mutex_lock(&workspace->lock);
+    for (int w = 0; w < numWriters; w++) {
+        while (workspace->writers[w]->busy) {
+            pthread_cond_wait(&workspace->finished, &workspace->lock);
+        }
+    }
+    pthread_mutex_unlock(&workspace->lock);
+
+    int failures = numDestinations;
+    for (int w = 0; w < numWriters; w++) {
+        FanOutWriter* writer = workspace->writers[w];
+        close(writer->fd);
+        for (int i = 0; i < numDestinations; i++) {
+            if (destinationPaths[i] == writer->destinationPath) {
+                results[i] = writer->result;
+            }
+        }
+        failures -= writer->result == 0;
+    }
+
+    freeFanOutWorkspace(temporary);
+    pthread_mutex_destroy(&ring.lock);
+    pthread_cond_destroy(&ring.filled);
+    pthread_cond_destroy(&ring.drained);
+    close(sourceFile);
+    return failures;
+}
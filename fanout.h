@@ -0,0 +1,23 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+#include "options.h"
+
+// Size and number of the buffers shared between the reader and the destination writers
+#define FANOUT_CHUNK_SIZE (1024 * 1024)
+#define FANOUT_SLOTS 4
+// A destination holding up the reader this long, while others wait for more, is detached
+// and reads the rest of the source itself
+#define FANOUT_LAG_NS (100 * 1000 * 1000)
+
+// Buffers and writer threads reused by successive fan-out copies
+typedef struct FanOutWorkspace FanOutWorkspace;
+
+// Function prototypes
+FanOutWorkspace* createFanOutWorkspace();
+
+void freeFanOutWorkspace(FanOutWorkspace* workspace);
+
+int copyFileFanOut(const char* sourcePath, char** destinationPaths, int numDestinations,
+                   ProgramOptions opts, int* results, FanOutWorkspace* workspace);
+
+#endif
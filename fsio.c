@@ -0,0 +1,403 @@
+#include "fsio.h"
+#include "log.h"
+#include "hash.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+// Directory fds kept open at most, the least recently used unpinned one is closed first
+#define FSIO_MAX_CACHED 128
+#define FSIO_BUCKETS 256
+
+struct FsioEntry {
+    char* path;  // Normalised directory path
+    int fd;
+    int pins;    // Callers currently using fd (it is only closed when 0)
+    int stale;   // Removed from the cache while pinned, closed on the last release
+    FsioEntry* bucketNext;
+    FsioEntry* newer; // Recency list, most recently used at fsioNewest
+    FsioEntry* older;
+};
+
+// Parent directory fd and final component of a path
+typedef struct {
+    int fd;
+    FsioEntry* entry; // Cache entry pinned for fd (NULL when fd is owned and must be closed)
+    char* copy;       // Normalised copy of the path that name points into
+    const char* name;
+} FsioTarget;
+
+static FsioEntry* fsioBuckets[FSIO_BUCKETS];
+static FsioEntry* fsioNewest = NULL;
+static FsioEntry* fsioOldest = NULL;
+static size_t fsioCount = 0;
+static int fsioRegistered = 0;
+static pthread_mutex_t fsioLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Function to join a directory and a name into a newly allocated path (no length limit)
+char* fsioJoinPath(const char* directory, const char* name) {
+    size_t size = strlen(directory) + strlen(name) + 2;
+    char* path = (char*)malloc(size);
+    if (path == NULL) {
+        logErrno("Memory allocation error");
+        return NULL;
+    }
+
+    snprintf(path, size, "%s/%s", directory, name);
+    return path;
+}
+
+// Helper function to copy a path with any trailing separators removed ("/" is kept)
+static char* fsioNormalise(const char* path) {
+    char* copy = strdup(path);
+    if (copy == NULL) {
+        logErrno("Memory allocation error");
+        return NULL;
+    }
+
+    size_t length = strlen(copy);
+    while (length > 1 && copy[length - 1] == '/') {
+        copy[--length] = '\0';
+    }
+    return copy;
+}
+
+static FsioEntry** fsioBucket(const char* path) {
+    return &fsioBuckets[hashBytes(HASH_INITIAL, path, strlen(path)) & (FSIO_BUCKETS - 1)];
+}
+
+// Helper function to unlink an entry from the recency list (lock held)
+static void fsioUnlinkRecent(FsioEntry* entry) {
+    if (entry->newer != NULL) {entry->newer->older = entry->older;} else {fsioNewest = entry->older;}
+    if (entry->older != NULL) {entry->older->newer = entry->newer;} else {fsioOldest = entry->newer;}
+    entry->newer = NULL;
+    entry->older = NULL;
+}
+
+// Helper function to put an entry (not in the recency list) at its newest end (lock held)
+static void fsioPushNewest(FsioEntry* entry) {
+    entry->older = fsioNewest;
+    if (fsioNewest != NULL) {fsioNewest->newer = entry;}
+    fsioNewest = entry;
+    if (fsioOldest == NULL) {fsioOldest = entry;}
+}
+
+// Helper function to mark a cached entry as the most recently used (lock held)
+static void fsioTouch(FsioEntry* entry) {
+    if (fsioNewest != entry) {
+        fsioUnlinkRecent(entry);
+        fsioPushNewest(entry);
+    }
+}
+
+// Helper function returning the cached entry for path, or NULL (lock held)
+static FsioEntry* fsioLookup(const char* path) {
+    for (FsioEntry* entry = *fsioBucket(path); entry != NULL; entry = entry->bucketNext) {
+        if (strcmp(entry->path, path) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Helper function to take an entry out of the cache, closing its fd unless it is pinned (lock held)
+static void fsioRemove(FsioEntry* entry) {
+    FsioEntry** link = fsioBucket(entry->path);
+    while (*link != entry) {
+        link = &(*link)->bucketNext;
+    }
+    *link = entry->bucketNext;
+    fsioUnlinkRecent(entry);
+    fsioCount--;
+
+    if (entry->pins > 0) {
+        entry->stale = 1;
+        return;
+    }
+    close(entry->fd);
+    free(entry->path);
+    free(entry);
+}
+
+// Helper function to add a directory fd to the cache, pinned, making room by closing the
+// least recently used unpinned fd. Returns NULL if every cached fd is in use. (lock held)
+static FsioEntry* fsioInsert(char* path, int fd) {
+    if (fsioCount >= FSIO_MAX_CACHED) {
+        FsioEntry* victim = fsioOldest;
+        while (victim != NULL && victim->pins > 0) {
+            victim = victim->newer;
+        }
+        if (victim == NULL) {
+            return NULL;
+        }
+        fsioRemove(victim);
+    }
+
+    FsioEntry* entry = (FsioEntry*)calloc(1, sizeof(FsioEntry));
+    if (entry == NULL) {
+        return NULL;
+    }
+    entry->path = path;
+    entry->fd = fd;
+    entry->pins = 1;
+    FsioEntry** bucket = fsioBucket(path);
+    entry->bucketNext = *bucket;
+    *bucket = entry;
+    fsioPushNewest(entry);
+    fsioCount++;
+
+    if (!fsioRegistered) {
+        atexit(fsioCloseAll);
+        fsioRegistered = 1;
+    }
+    return entry;
+}
+
+// Helper function to drop cached fds for a directory that was renamed or removed, and for
+// everything below it, as their paths now name something else (or nothing)
+static void fsioInvalidate(const char* path) {
+    char* key = fsioNormalise(path);
+    if (key == NULL) {
+        return;
+    }
+    size_t length = strlen(key);
+
+    pthread_mutex_lock(&fsioLock);
+    FsioEntry* entry = fsioNewest;
+    while (entry != NULL) {
+        FsioEntry* next = entry->older;
+        if (strncmp(entry->path, key, length) == 0 && (entry->path[length] == '\0' || entry->path[length] == '/')) {
+            fsioRemove(entry);
+        }
+        entry = next;
+    }
+    pthread_mutex_unlock(&fsioLock);
+    free(key);
+}
+
+// Helper function to find the parent directory fd and final component of a path
+static int fsioResolve(const char* path, FsioTarget* target) {
+    target->fd = AT_FDCWD;
+    target->entry = NULL;
+    target->copy = fsioNormalise(path);
+    if (target->copy == NULL) {
+        return 1;
+    }
+
+    char* slash = strrchr(target->copy, '/');
+    if (slash == NULL || strcmp(target->copy, "/") == 0) {
+        // Relative to the working directory, or the root itself
+        target->name = target->copy;
+        return 0;
+    }
+
+    target->name = slash + 1;
+    if (slash == target->copy) {
+        target->fd = fsioDirFd("/", &target->entry);
+    } else {
+        *slash = '\0';
+        target->fd = fsioDirFd(target->copy, &target->entry);
+    }
+    if (target->fd == -1) {
+        free(target->copy);
+        target->copy = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+static void fsioRelease(FsioTarget* target) {
+    if (target->fd != AT_FDCWD) {
+        fsioReleaseDirFd(target->fd, target->entry);
+    }
+    free(target->copy);
+}
+
+// Function to get an fd for a directory, opened relative to its parent's cached fd. The
+// fd must be handed back to fsioReleaseDirFd with *entry once the caller is done with it.
+int fsioDirFd(const char* directory, FsioEntry** entry) {
+    *entry = NULL;
+    char* key = fsioNormalise(directory);
+    if (key == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&fsioLock);
+    FsioEntry* cached = fsioLookup(key);
+    if (cached != NULL) {
+        cached->pins++;
+        fsioTouch(cached);
+        pthread_mutex_unlock(&fsioLock);
+        free(key);
+        *entry = cached;
+        return cached->fd;
+    }
+    pthread_mutex_unlock(&fsioLock);
+
+    FsioTarget target;
+    if (fsioResolve(key, &target) != 0) {
+        free(key);
+        return -1;
+    }
+    int fd = openat(target.fd, target.name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    fsioRelease(&target);
+    if (fd == -1) {
+        free(key);
+        return -1;
+    }
+
+    pthread_mutex_lock(&fsioLock);
+    cached = fsioLookup(key);
+    if (cached != NULL) {
+        // Another thread cached it first
+        close(fd);
+        free(key);
+        cached->pins++;
+        fsioTouch(cached);
+        *entry = cached;
+        fd = cached->fd;
+    } else {
+        *entry = fsioInsert(key, fd);
+        if (*entry == NULL) {
+            free(key); // Not cached, the caller's release closes fd
+        }
+    }
+    pthread_mutex_unlock(&fsioLock);
+
+    return fd;
+}
+
+// Function to hand back an fd returned by fsioDirFd
+void fsioReleaseDirFd(int fd, FsioEntry* entry) {
+    if (entry == NULL) {
+        close(fd);
+        return;
+    }
+
+    pthread_mutex_lock(&fsioLock);
+    if (--entry->pins == 0 && entry->stale) {
+        close(entry->fd);
+        free(entry->path);
+        free(entry);
+    }
+    pthread_mutex_unlock(&fsioLock);
+}
+
+// Function to open a directory stream with its own file position
+DIR* fsioOpenDir(const char* directory) {
+    FsioEntry* entry;
+    int fd = fsioDirFd(directory, &entry);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    int streamFd = openat(fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    fsioReleaseDirFd(fd, entry);
+    if (streamFd == -1) {
+        return NULL;
+    }
+
+    DIR* dir = fdopendir(streamFd);
+    if (dir == NULL) {
+        close(streamFd);
+    }
+    return dir;
+}
+
+int fsioStat(const char* path, struct stat* statbuf) {
+    FsioTarget target;
+    if (fsioResolve(path, &target) != 0) {
+        return -1;
+    }
+
+    int result = fstatat(target.fd, target.name, statbuf, 0);
+    fsioRelease(&target);
+    return result;
+}
+
+int fsioOpen(const char* path, int flags, mode_t mode) {
+    FsioTarget target;
+    if (fsioResolve(path, &target) != 0) {
+        return -1;
+    }
+
+    int fd = openat(target.fd, target.name, flags | O_CLOEXEC, mode);
+    fsioRelease(&target);
+    return fd;
+}
+
+int fsioMkdir(const char* path, mode_t mode) {
+    FsioTarget target;
+    if (fsioResolve(path, &target) != 0) {
+        return -1;
+    }
+
+    int result = mkdirat(target.fd, target.name, mode);
+    fsioRelease(&target);
+    return result;
+}
+
+int fsioRename(const char* oldPath, const char* newPath) {
+    FsioTarget oldTarget, newTarget;
+    if (fsioResolve(oldPath, &oldTarget) != 0) {
+        return -1;
+    }
+    if (fsioResolve(newPath, &newTarget) != 0) {
+        fsioRelease(&oldTarget);
+        return -1;
+    }
+
+    int result = renameat(oldTarget.fd, oldTarget.name, newTarget.fd, newTarget.name);
+    fsioRelease(&oldTarget);
+    fsioRelease(&newTarget);
+
+    // Either path may have been a directory
+    if (result == 0) {
+        fsioInvalidate(oldPath);
+        fsioInvalidate(newPath);
+    }
+    return result;
+}
+
+int fsioUnlink(const char* path) {
+    FsioTarget target;
+    if (fsioResolve(path, &target) != 0) {
+        return -1;
+    }
+
+    int result = unlinkat(target.fd, target.name, 0);
+    fsioRelease(&target);
+    if (result == 0) {
+        fsioInvalidate(path);
+    }
+    return result;
+}
+
+int fsioLink(const char* existingPath, const char* newPath) {
+    FsioTarget existingTarget, newTarget;
+    if (fsioResolve(existingPath, &existingTarget) != 0) {
+        return -1;
+    }
+    if (fsioResolve(newPath, &newTarget) != 0) {
+        fsioRelease(&existingTarget);
+        return -1;
+    }
+
+    // A symbolic link is linked to the file it names, as that is what was scanned
+    int result = linkat(existingTarget.fd, existingTarget.name, newTarget.fd, newTarget.name, AT_SYMLINK_FOLLOW);
+    fsioRelease(&existingTarget);
+    fsioRelease(&newTarget);
+    return result;
+}
+
+// Function to empty the cache, closing every fd not in use (registered with atexit)
+void fsioCloseAll() {
+    pthread_mutex_lock(&fsioLock);
+    while (fsioOldest != NULL) {
+        fsioRemove(fsioOldest);
+    }
+    pthread_mutex_unlock(&fsioLock);
+}
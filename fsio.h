@@ -0,0 +1,38 @@
+#ifndef FSIO_H
+#define FSIO_H
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// Directory-fd-relative file operations. Each directory's fd is opened once,
+// relative to its parent's cached fd, so an operation on "dir/name" costs a
+// single-component lookup instead of a walk of the whole path. Paths of any
+// length are supported, they are never handed to the kernel whole.
+
+// Cached directory fd, pinned while a caller uses it
+typedef struct FsioEntry FsioEntry;
+
+// Function prototypes
+char* fsioJoinPath(const char* directory, const char* name);
+
+DIR* fsioOpenDir(const char* directory);
+
+int fsioStat(const char* path, struct stat* statbuf);
+
+int fsioOpen(const char* path, int flags, mode_t mode);
+
+int fsioMkdir(const char* path, mode_t mode);
+
+int fsioRename(const char* oldPath, const char* newPath);
+
+int fsioUnlink(const char* path);
+
+int fsioLink(const char* existingPath, const char* newPath);
+
+int fsioDirFd(const char* directory, FsioEntry** entry);
+
+void fsioReleaseDirFd(int fd, FsioEntry* entry);
+
+void fsioCloseAll();
+
+#endif
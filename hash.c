@@ -0,0 +1,44 @@
+#include "hash.h"
+#include "log.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define HASH_BUFFER_SIZE (256 * 1024)
+
+// Function to extend a 64-bit FNV-1a hash with the given bytes
+uint64_t hashBytes(uint64_t hash, const void* data, size_t length) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Function to hash length bytes of an open file starting at start (0 on success)
+int hashFileRange(int fd, off_t start, off_t length, uint64_t* hash) {
+    char* buffer = (char*)malloc(HASH_BUFFER_SIZE);
+    if (buffer == NULL) {
+        logErrno("Memory allocation error");
+        return 1;
+    }
+
+    uint64_t result = HASH_INITIAL;
+    while (length > 0) {
+        size_t chunk = length < HASH_BUFFER_SIZE ? (size_t)length : HASH_BUFFER_SIZE;
+        ssize_t bytesRead = pread(fd, buffer, chunk, start);
+        if (bytesRead <= 0) {
+            // Short file or read error, the range can't be hashed
+            free(buffer);
+            return 1;
+        }
+        result = hashBytes(result, buffer, bytesRead);
+        start += bytesRead;
+        length -= bytesRead;
+    }
+
+    free(buffer);
+    *hash = result;
+    return 0;
+}
@@ -0,0 +1,14 @@
+#ifndef HASH_H
+#define HASH_H
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define HASH_INITIAL 0xcbf29ce484222325ULL
+
+// Function prototypes
+uint64_t hashBytes(uint64_t hash, const void* data, size_t length);
+
+int hashFileRange(int fd, off_t start, off_t length, uint64_t* hash);
+
+#endif
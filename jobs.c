@@ -0,0 +1,389 @@
+#include "jobs.h"
+#include "libmysync.h"
+#include "utility.h"
+#include "trace.h"
+#include "log.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+
+typedef struct {
+    double cost;
+    int index;
+} JobRank;
+
+// Shared state of the worker pool
+typedef struct {
+    JobList* list;
+    JobRank* order; // Jobs in the order they are executed
+    int nextPrepare; // Next job to plan (in file order)
+    int nextExecute; // Next entry of order to execute
+    int numPrepared; // Jobs planned so far, execution starts once all are
+    pthread_mutex_t lock;
+    pthread_cond_t prepared;
+} JobPool;
+
+// Helper function to split a job line into arguments, honouring '...' and "..." quoting.
+// Returns the number of arguments (after argv[0]), or -1 on error.
+static int splitJobLine(char* line, char*** argvOut) {
+    char** argv = (char**)malloc(2 * sizeof(char*));
+    if (argv == NULL) {
+        logErrno("Memory allocation error");
+        return -1;
+    }
+    argv[0] = "mysync";
+    int argc = 1;
+
+    char* in = line;
+    while (*in != '\0') {
+        while (isspace((unsigned char)*in)) {
+            in++;
+        }
+        if (*in == '\0' || (argc == 1 && *in == '#')) {
+            break;
+        }
+
+        // Unquote in place; the argument never grows
+        char* argument = in;
+        char* out = in;
+        char quote = 0;
+        while (*in != '\0' && (quote || !isspace((unsigned char)*in))) {
+            if (quote && *in == quote) {
+                quote = 0;
+            } else if (!quote && (*in == '\'' || *in == '"')) {
+                quote = *in;
+            } else {
+                *out++ = *in;
+            }
+            in++;
+        }
+        if (quote) {
+            free(argv);
+            return -1;
+        }
+        if (*in != '\0') {
+            in++;
+        }
+        *out = '\0';
+
+        char** newArgv = (char**)realloc(argv, (argc + 2) * sizeof(char*));
+        if (newArgv == NULL) {
+            logErrno("Memory allocation error");
+            free(argv);
+            return -1;
+        }
+        argv = newArgv;
+        argv[argc++] = argument;
+    }
+
+    argv[argc] = NULL;
+    *argvOut = argv;
+    return argc - 1;
+}
+
+// Helper function to append an empty job for a line (NULL if out of memory)
+static SyncJob* addJob(JobList* list, int lineNumber) {
+    SyncJob* newJobs = (SyncJob*)realloc(list->jobs, (list->numJobs + 1) * sizeof(SyncJob));
+    if (newJobs == NULL) {
+        logErrno("Memory allocation error");
+        return NULL;
+    }
+    list->jobs = newJobs;
+
+    SyncJob* job = &list->jobs[list->numJobs++];
+    memset(job, 0, sizeof(SyncJob));
+    job->lineNumber = lineNumber;
+    return job;
+}
+
+// Function to read a job file: one sync set per line, written as mysync's own arguments
+// (options then directories). Blank lines and lines starting with # are skipped. A line
+// that can't be parsed is reported and kept as a failed job, so the others still run.
+JobList* readJobFile(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        logErrno("Error opening job file");
+        return NULL;
+    }
+
+    JobList* list = (JobList*)calloc(1, sizeof(JobList));
+    if (list == NULL) {
+        logErrno("Memory allocation error");
+        fclose(file);
+        return NULL;
+    }
+
+    char* line = NULL;
+    size_t lineSize = 0;
+    int lineNumber = 0;
+    int failed = 0;
+    while (!failed && getline(&line, &lineSize, file) != -1) {
+        lineNumber++;
+
+        char** argv;
+        int numArguments = splitJobLine(line, &argv);
+        if (numArguments == 0) {
+            free(argv);
+            continue;
+        }
+
+        SyncJob* job = addJob(list, lineNumber);
+        if (job == NULL) {
+            if (numArguments != -1) {free(argv);}
+            failed = 1;
+            break;
+        }
+        job->name = JOB_UNPARSED_NAME;
+        job->result = 1;
+
+        if (numArguments == -1) {
+            logMessage(LOG_LEVEL_ERROR, "Error: %s line %d: unterminated quote.\n", path, lineNumber);
+            continue;
+        }
+
+        ProgramOptions opts;
+        int parseFailed = parseOptions(numArguments + 1, argv, &opts);
+        free(argv);
+        if (parseFailed) {
+            logMessage(LOG_LEVEL_ERROR, "Error: %s line %d: invalid arguments.\n", path, lineNumber);
+            continue;
+        }
+        if (opts.optionF || opts.numDirectories < 2) {
+            logMessage(LOG_LEVEL_ERROR, "Error: %s line %d: %s.\n", path, lineNumber,
+                       opts.optionF ? "job files can't be nested" : "at least two directories are required");
+            freeProgramOptions(&opts);
+            continue;
+        }
+
+        job->name = opts.directories[0];
+        job->opts = opts;
+        job->result = 0;
+    }
+
+    free(line);
+    fclose(file);
+    if (failed) {
+        freeJobList(list);
+        return NULL;
+    }
+    return list;
+}
+
+// Helper function counting each finished destination towards its job's stats
+static void jobProgress(const SyncProgress* progress, void* userData) {
+    SyncJob* job = (SyncJob*)userData;
+    if (progress->result == 0) {
+        job->numCopied++;
+    } else {
+        job->numFailed++;
+    }
+    job->bytesCopied = progress->bytesCopied;
+}
+
+// Helper function to scan and plan a job, estimating how long it will take
+static void prepareJob(SyncJob* job) {
+    if (job->result != 0) {
+        return; // Its line couldn't be parsed
+    }
+
+    TRACE_BEGIN("job-plan", job->name);
+    job->context = mysyncCreate(job->opts);
+    if (job->context == NULL) {
+        job->result = 1;
+        TRACE_END("job-plan", job->name);
+        return;
+    }
+    mysyncSetProgressCallback(job->context, jobProgress, job);
+
+    if (mysyncScan(job->context) != 0 || mysyncPlan(job->context) != 0) {
+        logMessage(LOG_LEVEL_ERROR, "Job %d (%s) could not be planned\n", job->lineNumber, job->name);
+        job->result = 1;
+    } else {
+        SyncEstimate estimate;
+        if (mysyncEstimate(job->context, &estimate) == 0) {
+            if (job->opts.optionN) {
+                printSyncEstimate(&estimate);
+            }
+            job->estimatedSeconds = estimate.seconds;
+            freeSyncEstimate(&estimate);
+        }
+    }
+    TRACE_END("job-plan", job->name);
+}
+
+// Helper function to run a planned job's copies
+static void executeJob(SyncJob* job) {
+    if (job->result != 0) {
+        return;
+    }
+    if (job->opts.optionW && job->estimatedSeconds > job->opts.window) {
+        logMessage(LOG_LEVEL_INFO, "Deferring job %d (%s): predicted %.1f s exceeds the %d s window\n",
+                   job->lineNumber, job->name, job->estimatedSeconds, job->opts.window);
+        job->result = MYSYNC_DEFERRED;
+        return;
+    }
+
+    TRACE_BEGIN("job-execute", job->name);
+    double start = monotonicSeconds();
+    if (mysyncExecute(job->context) != 0) {
+        job->result = 1;
+    }
+    job->seconds = monotonicSeconds() - start;
+    TRACE_END("job-execute", job->name);
+}
+
+// Helper function to hand out the next job index, or -1 when none are left
+static int nextJob(JobPool* pool, int execute) {
+    pthread_mutex_lock(&pool->lock);
+    int index = -1;
+    if (!execute && pool->nextPrepare < pool->list->numJobs) {
+        index = pool->nextPrepare++;
+    } else if (execute && pool->nextExecute < pool->list->numJobs) {
+        index = pool->order[pool->nextExecute++].index;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return index;
+}
+
+// Helper function for qsort, most expensive job first
+static int compareJobCost(const void* a, const void* b) {
+    double costA = ((const JobRank*)a)->cost;
+    double costB = ((const JobRank*)b)->cost;
+    return (costA < costB) - (costA > costB);
+}
+
+// Helper function run by each worker: plan jobs until none are left, wait for all of
+// them to be planned, then execute jobs in order of decreasing cost so the longest
+// jobs don't start last and leave the other workers idle
+static void* jobWorkerMain(void* arg) {
+    JobPool* pool = (JobPool*)arg;
+    int numJobs = pool->list->numJobs;
+
+    int index;
+    while ((index = nextJob(pool, 0)) != -1) {
+        prepareJob(&pool->list->jobs[index]);
+
+        pthread_mutex_lock(&pool->lock);
+        if (++pool->numPrepared == numJobs) {
+            // Last job planned: rank them all for execution
+            for (int i = 0; i < numJobs; i++) {
+                pool->order[i].index = i;
+                pool->order[i].cost = pool->list->jobs[i].estimatedSeconds;
+            }
+            qsort(pool->order, numJobs, sizeof(JobRank), compareJobCost);
+            pthread_cond_broadcast(&pool->prepared);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->numPrepared < numJobs) {
+        pthread_cond_wait(&pool->prepared, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    while ((index = nextJob(pool, 1)) != -1) {
+        executeJob(&pool->list->jobs[index]);
+    }
+    return NULL;
+}
+
+// Helper function to print every job's stats and the totals
+static void reportJobs(JobList* list, double seconds) {
+    int numFailedJobs = 0;
+    int numCopied = 0;
+    int numFailed = 0;
+    long long bytesCopied = 0;
+
+    for (int i = 0; i < list->numJobs; i++) {
+        SyncJob* job = &list->jobs[i];
+        logResult("Job %d (%s): %s, %d copied, %d failed, %.1f MiB in %.2f s\n",
+                  job->lineNumber, job->name,
+                  job->result == 0 ? "ok" : job->result == MYSYNC_DEFERRED ? "deferred" : "FAILED",
+                  job->numCopied, job->numFailed, job->bytesCopied / 1048576.0, job->seconds);
+        numFailedJobs += job->result != 0 && job->result != MYSYNC_DEFERRED;
+        numCopied += job->numCopied;
+        numFailed += job->numFailed;
+        bytesCopied += job->bytesCopied;
+    }
+
+    logResult("Jobs: %d run, %d failed; %d files copied, %d failed, %.1f MiB in %.2f s\n",
+              list->numJobs, numFailedJobs, numCopied, numFailed, bytesCopied / 1048576.0, seconds);
+}
+
+// Function to run every job on a pool of numWorkers threads. Returns 0 if all succeeded,
+// 1 if any failed, otherwise MYSYNC_DEFERRED if any were deferred.
+int runJobs(JobList* list, int numWorkers) {
+    if (list->numJobs == 0) {
+        return 0;
+    }
+    if (numWorkers > list->numJobs) {
+        numWorkers = list->numJobs;
+    }
+
+    JobPool pool;
+    pool.list = list;
+    pool.nextPrepare = 0;
+    pool.nextExecute = 0;
+    pool.numPrepared = 0;
+    pool.order = (JobRank*)malloc(list->numJobs * sizeof(JobRank));
+    pthread_t* threads = (pthread_t*)malloc(numWorkers * sizeof(pthread_t));
+    if (pool.order == NULL || threads == NULL) {
+        logErrno("Memory allocation error");
+        free(pool.order);
+        free(threads);
+        return 1;
+    }
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.prepared, NULL);
+
+    double start = monotonicSeconds();
+    // The calling thread is the first worker
+    int numThreads = 1;
+    for (; numThreads < numWorkers; numThreads++) {
+        if (pthread_create(&threads[numThreads], NULL, jobWorkerMain, &pool) != 0) {
+            break;
+        }
+    }
+    if (numThreads < numWorkers) {
+        logMessage(LOG_LEVEL_WARN, "Started %d of %d workers\n", numThreads, numWorkers);
+    }
+    jobWorkerMain(&pool);
+    for (int i = 1; i < numThreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    reportJobs(list, monotonicSeconds() - start);
+
+    pthread_cond_destroy(&pool.prepared);
+    pthread_mutex_destroy(&pool.lock);
+    free(pool.order);
+    free(threads);
+
+    int result = 0;
+    for (int i = 0; i < list->numJobs; i++) {
+        if (list->jobs[i].result == MYSYNC_DEFERRED) {
+            result = MYSYNC_DEFERRED;
+        } else if (list->jobs[i].result != 0) {
+            return 1;
+        }
+    }
+    return result;
+}
+
+// Function to free a job list and every job's context
+void freeJobList(JobList* list) {
+    if (list == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < list->numJobs; i++) {
+        SyncJob* job = &list->jobs[i];
+        mysyncDestroy(job->context);
+        freeProgramOptions(&job->opts);
+    }
+    free(list->jobs);
+    free(list);
+}
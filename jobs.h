@@ -0,0 +1,35 @@
+#ifndef JOBS_H
+#define JOBS_H
+#include "options.h"
+#include "libmysync.h"
+
+// Name reported for a job whose line couldn't be parsed
+#define JOB_UNPARSED_NAME "unparsed line"
+
+// One sync set from a job file (-f) and what happened when it ran
+typedef struct {
+    int lineNumber;
+    const char* name;    // First directory, used in reports
+    ProgramOptions opts;
+    MysyncContext* context;
+    double estimatedSeconds; // Predicted from the plan and measured rates
+    int result;          // 0 if the job planned and copied everything, MYSYNC_DEFERRED if deferred (-w)
+    int numCopied;
+    int numFailed;
+    long long bytesCopied;
+    double seconds;      // Time spent executing the plan
+} SyncJob;
+
+typedef struct {
+    SyncJob* jobs;
+    int numJobs;
+} JobList;
+
+// Function prototypes
+JobList* readJobFile(const char* path);
+
+int runJobs(JobList* list, int numWorkers);
+
+void freeJobList(JobList* list);
+
+#endif
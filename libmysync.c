@@ -0,0 +1,249 @@
+#include "libmysync.h"
+#include "utility.h"
+#include "plan.h"
+#include "estimate.h"
+#include "pipeline.h"
+#include "fsio.h"
+#include "log.h"
+#include "trace.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+struct MysyncContext {
+    ProgramOptions opts;
+    SyncedContent* content; // Result of the last mysyncScan (NULL before)
+    SyncPlan* plan;         // Result of the last mysyncPlan (NULL before)
+    SyncResources resources;
+};
+
+// Number of contexts currently scanning, planning or executing
+static int activeContexts = 0;
+static pthread_mutex_t activeLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Helper function to mark a context as busy. With flushCache, cached directory fds are
+// dropped if no other context is busy (under the lock, so none can start meanwhile).
+static void beginOperation(int flushCache) {
+    pthread_mutex_lock(&activeLock);
+    if (flushCache && activeContexts == 0) {
+        fsioCloseAll();
+    }
+    activeContexts++;
+    pthread_mutex_unlock(&activeLock);
+}
+
+static void endOperation() {
+    pthread_mutex_lock(&activeLock);
+    activeContexts--;
+    pthread_mutex_unlock(&activeLock);
+}
+
+// Function to create a context from parsed options. The options' directories and
+// pattern strings must stay valid for the life of the context.
+MysyncContext* mysyncCreate(ProgramOptions opts) {
+    MysyncContext* context = (MysyncContext*)calloc(1, sizeof(MysyncContext));
+    if (context == NULL) {
+        logErrno("Memory allocation error");
+        return NULL;
+    }
+
+    context->opts = opts;
+    // Compile the patterns once, into the context's own copy, so the caller's options can
+    // be reused (parseCommandLine leaves them uncompiled)
+    context->opts.ignoreRegexes = NULL;
+    context->opts.considerRegexes = NULL;
+    if (compilePatterns(&context->opts) != 0) {
+        mysyncDestroy(context);
+        return NULL;
+    }
+    return context;
+}
+
+// Function to change the directories synchronised by later scans
+int mysyncSetDirectories(MysyncContext* context, char** directories, int numDirectories) {
+    if (numDirectories < 2) {
+        logMessage(LOG_LEVEL_ERROR, "At least two directories are required\n");
+        return 1;
+    }
+
+    context->opts.directories = directories;
+    context->opts.numDirectories = numDirectories;
+    return 0;
+}
+
+// Function to set a callback invoked after each destination file is written
+void mysyncSetProgressCallback(MysyncContext* context, SyncProgressCallback callback, void* userData) {
+    context->resources.progress = callback;
+    context->resources.progressData = userData;
+}
+
+// Function to read the contents of the context's directories, replacing any earlier scan
+int mysyncScan(MysyncContext* context) {
+    if (context->opts.numDirectories < 2) {
+        logMessage(LOG_LEVEL_ERROR, "At least two directories are required\n");
+        return 1;
+    }
+
+    // Directories may have been replaced since an earlier run
+    beginOperation(1);
+
+    freeSyncPlan(context->plan);
+    context->plan = NULL;
+    freeSyncedContent(context->content);
+
+    TRACE_BEGIN("scan", context->opts.directories[0]);
+    context->content = readFiles(context->opts.directories, context->opts.numDirectories, context->opts);
+    TRACE_END("scan", context->opts.directories[0]);
+
+    if (context->content != NULL && context->opts.optionV) {
+        debugPrintSyncedContent(context->content);
+    }
+    endOperation();
+    return context->content == NULL;
+}
+
+// Function to plan the copies needed by the last scan. Missing destination directories
+// are only recorded, and made by mysyncExecute, so a plan that is never executed (-n, a
+// deferred -w run or job) leaves the destinations untouched.
+int mysyncPlan(MysyncContext* context) {
+    if (context->content == NULL) {
+        logMessage(LOG_LEVEL_ERROR, "mysyncPlan called before mysyncScan\n");
+        return 1;
+    }
+
+    freeSyncPlan(context->plan);
+    context->plan = createSyncPlan();
+    if (context->plan == NULL) {
+        return 1;
+    }
+    context->plan->deferDirectories = 1;
+
+    beginOperation(0);
+    int failures = planSyncFiles(context->content, context->opts, context->plan);
+    if (context->opts.optionS) {
+        orderSyncPlan(context->plan, context->opts.copyOrder);
+    }
+    endOperation();
+    return failures;
+}
+
+// Function to get the plan built by the last mysyncPlan (NULL before)
+const SyncPlan* mysyncGetPlan(const MysyncContext* context) {
+    return context->plan;
+}
+
+// Function to predict the work and duration of the last plan (free with freeSyncEstimate)
+int mysyncEstimate(const MysyncContext* context, SyncEstimate* estimate) {
+    if (context->plan == NULL) {
+        logMessage(LOG_LEVEL_ERROR, "mysyncEstimate called before mysyncPlan\n");
+        return 1;
+    }
+    return estimateSyncPlan(context->plan, context->opts, estimate);
+}
+
+// Function to carry out the last plan, returns the number of failed copies. A dry run
+// (-n) performs nothing. Otherwise the measured rates are stored for later estimates.
+int mysyncExecute(MysyncContext* context) {
+    if (context->plan == NULL) {
+        logMessage(LOG_LEVEL_ERROR, "mysyncExecute called before mysyncPlan\n");
+        return 1;
+    }
+
+    int failures = 0;
+    if (!context->opts.optionN) {
+        beginOperation(0);
+        failures = executeSyncPlan(context->plan, context->opts, &context->resources);
+        endOperation();
+        recordSyncRates(context->plan, context->opts);
+    }
+
+    // A plan is only valid for the tree it was made from
+    freeSyncPlan(context->plan);
+    context->plan = NULL;
+    return failures;
+}
+
+// Helper function to plan and copy at the same time: each directory's copies are
+// handed to the device queues as soon as it is planned, and start while the rest is scanned
+static int planAndExecute(MysyncContext* context) {
+    freeSyncPlan(context->plan);
+    context->plan = createSyncPlan();
+    if (context->plan == NULL) {
+        return 1;
+    }
+
+    beginOperation(0);
+    SyncPipeline* pipeline = startSyncPipeline(context->opts, &context->resources);
+    if (pipeline == NULL) {
+        endOperation();
+        return 1;
+    }
+    context->plan->sink = submitSyncBatch;
+    context->plan->sinkData = pipeline;
+
+    // Copies already submitted are finished even if planning fails part way
+    int result = planSyncFiles(context->content, context->opts, context->plan);
+    if (result == 0) {
+        result = flushSyncPlan(context->plan);
+    }
+    SyncPlan* executed;
+    if (finishSyncPipeline(pipeline, &executed) != 0) {
+        result = 1;
+    }
+    endOperation();
+
+    if (executed != NULL) {
+        recordSyncRates(executed, context->opts);
+    }
+    freeSyncPlan(executed);
+    freeSyncPlan(context->plan);
+    context->plan = NULL;
+    return result;
+}
+
+// Function to scan, plan and execute in one call. A dry run (-n) prints the estimate
+// instead of executing; with -w, a sync predicted to overrun the window returns
+// MYSYNC_DEFERRED without executing. Otherwise copying overlaps planning, except with
+// move detection (-m), whose links must all be made before anything is copied.
+int mysyncSync(MysyncContext* context) {
+    if (mysyncScan(context) != 0) {
+        return 1;
+    }
+    if (!context->opts.optionN && !context->opts.optionW && !context->opts.optionM) {
+        return planAndExecute(context);
+    }
+    if (mysyncPlan(context) != 0) {
+        return 1;
+    }
+
+    if (context->opts.optionN || context->opts.optionW) {
+        SyncEstimate estimate;
+        if (mysyncEstimate(context, &estimate) != 0) {
+            return 1;
+        }
+        if (context->opts.optionN) {
+            printSyncEstimate(&estimate);
+        }
+        double seconds = estimate.seconds;
+        freeSyncEstimate(&estimate);
+
+        if (context->opts.optionW && seconds > context->opts.window) {
+            logMessage(LOG_LEVEL_INFO, "Deferring: predicted %.1f s exceeds the %d s window\n", seconds, context->opts.window);
+            return MYSYNC_DEFERRED;
+        }
+    }
+    return mysyncExecute(context);
+}
+
+// Function to free a context and everything it holds
+void mysyncDestroy(MysyncContext* context) {
+    if (context == NULL) {
+        return;
+    }
+
+    freeSyncPlan(context->plan);
+    freeSyncedContent(context->content);
+    freeSyncResources(&context->resources);
+    freePatterns(&context->opts);
+    free(context);
+}
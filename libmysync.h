@@ -0,0 +1,48 @@
+#ifndef LIBMYSYNC_H
+#define LIBMYSYNC_H
+#include "options.h"
+#include "plan.h"
+#include "estimate.h"
+
+// Library interface to mysync. A context holds the options, compiled patterns, a pool of
+// copy buffers and fan-out writer threads, and the results of the last scan and plan, so
+// one process can run many syncs without re-parsing a command line or reallocating them
+// per run. Each execution still starts its device queue threads (-d per source device)
+// and joins them before returning:
+//
+//   MysyncContext* context = mysyncCreate(opts);
+//   mysyncSetDirectories(context, directories, numDirectories);
+//   if (mysyncScan(context) == 0 && mysyncPlan(context) == 0) {
+//       mysyncEstimate(context, &estimate); // optional, predicts the duration
+//       failures = mysyncExecute(context);
+//   }
+//   mysyncDestroy(context);
+//
+// A context must only be used by one thread at a time; separate contexts may run in parallel.
+typedef struct MysyncContext MysyncContext;
+
+// Returned by mysyncSync when the sync is predicted to overrun its window (-w)
+#define MYSYNC_DEFERRED 3
+
+// Function prototypes
+MysyncContext* mysyncCreate(ProgramOptions opts);
+
+int mysyncSetDirectories(MysyncContext* context, char** directories, int numDirectories);
+
+void mysyncSetProgressCallback(MysyncContext* context, SyncProgressCallback callback, void* userData);
+
+int mysyncScan(MysyncContext* context);
+
+int mysyncPlan(MysyncContext* context);
+
+const SyncPlan* mysyncGetPlan(const MysyncContext* context);
+
+int mysyncEstimate(const MysyncContext* context, SyncEstimate* estimate);
+
+int mysyncExecute(MysyncContext* context);
+
+int mysyncSync(MysyncContext* context);
+
+void mysyncDestroy(MysyncContext* context);
+
+#endif
@@ -0,0 +1,295 @@
+#include "log.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+// Bytes buffered per output stream, messages that don't fit are dropped
+#define LOG_RING_SIZE (1024 * 1024)
+#define LOG_MESSAGE_MAX 4096
+// The writer is woken early once this much is buffered, otherwise it drains on a timer
+#define LOG_FLUSH_THRESHOLD (LOG_RING_SIZE / 4)
+#define LOG_FLUSH_INTERVAL_NS (50 * 1000 * 1000)
+
+typedef struct {
+    int fd;
+    char* data;
+    size_t head; // Total bytes ever buffered
+    size_t tail; // Total bytes ever written out
+} LogRing;
+
+LogLevel logLevel = LOG_LEVEL_INFO;
+
+static LogRing logRings[2]; // stdout (info / verbose) and stderr (errors / warnings)
+static int logJson = 0;
+static int logRunning = 0;
+static int logStopping = 0;
+static unsigned long long logDropped = 0;
+static pthread_t logWriter;
+static pthread_mutex_t logLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t logWake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t logSpace = PTHREAD_COND_INITIALIZER; // The writer drained the rings
+
+// Helper function returning the bytes waiting in both rings (lock held)
+static size_t logPending() {
+    return (logRings[0].head - logRings[0].tail) + (logRings[1].head - logRings[1].tail);
+}
+
+// Helper function to write out everything buffered in a ring, without holding the lock
+// during the write. Producers only append past head, so the drained region is stable.
+static void logDrain(LogRing* ring) {
+    size_t tail = ring->tail;
+    size_t head = ring->head;
+    if (tail == head) {
+        return;
+    }
+
+    pthread_mutex_unlock(&logLock);
+    while (tail < head) {
+        size_t offset = tail % LOG_RING_SIZE;
+        size_t chunk = head - tail < LOG_RING_SIZE - offset ? head - tail : LOG_RING_SIZE - offset;
+        ssize_t written = write(ring->fd, ring->data + offset, chunk);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            break; // Output is gone, discard the rest of this batch
+        }
+        tail += written;
+    }
+    pthread_mutex_lock(&logLock);
+    ring->tail = head;
+}
+
+// Background writer, drains the rings in large writes
+static void* logWriterMain(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&logLock);
+    for (;;) {
+        if (!logStopping && logPending() < LOG_FLUSH_THRESHOLD) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += LOG_FLUSH_INTERVAL_NS;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&logWake, &logLock, &deadline);
+        }
+
+        int stopping = logStopping;
+        logDrain(&logRings[0]);
+        logDrain(&logRings[1]);
+        pthread_cond_broadcast(&logSpace);
+        if (stopping && logPending() == 0) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&logLock);
+    return NULL;
+}
+
+// Function to start the background log writer. Until it is started (and after shutdown)
+// messages are written synchronously.
+int logInit(LogLevel level, int json) {
+    logLevel = level;
+    logJson = json;
+
+    for (int i = 0; i < 2; i++) {
+        logRings[i].fd = i == 0 ? STDOUT_FILENO : STDERR_FILENO;
+        logRings[i].data = (char*)malloc(LOG_RING_SIZE);
+        logRings[i].head = 0;
+        logRings[i].tail = 0;
+        if (logRings[i].data == NULL) {
+            perror("Memory allocation error");
+            return 1;
+        }
+    }
+
+    // Anything already printed must come out first
+    fflush(stdout);
+    fflush(stderr);
+
+    if (pthread_create(&logWriter, NULL, logWriterMain, NULL) != 0) {
+        fprintf(stderr, "Error starting log writer\n");
+        return 1;
+    }
+    logRunning = 1;
+    atexit(logShutdown);
+    return 0;
+}
+
+// Helper function to escape a message into a JSON string body, dropping trailing newlines
+static size_t logEscape(char* output, size_t size, const char* message) {
+    size_t length = strlen(message);
+    while (length > 0 && message[length - 1] == '\n') {
+        length--;
+    }
+
+    size_t used = 0;
+    for (size_t i = 0; i < length && used + 7 < size; i++) {
+        unsigned char c = (unsigned char)message[i];
+        if (c == '"' || c == '\\') {
+            output[used++] = '\\';
+            output[used++] = c;
+        } else if (c == '\n') {
+            output[used++] = '\\';
+            output[used++] = 'n';
+        } else if (c < 0x20) {
+            used += snprintf(output + used, size - used, "\\u%04x", c);
+        } else {
+            output[used++] = c;
+        }
+    }
+    output[used] = '\0';
+    return used;
+}
+
+// Helper function to build the record for a message, returning its length (0 to skip it)
+static size_t logFormat(char* record, size_t size, const char* levelName, const char* message) {
+    if (!logJson) {
+        snprintf(record, size, "%s", message);
+        return strlen(record);
+    }
+
+    char escaped[LOG_MESSAGE_MAX * 2];
+    if (logEscape(escaped, sizeof(escaped), message) == 0) {
+        return 0; // Blank separator lines carry no information in JSON
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int length = snprintf(record, size, "{\"ts\":%lld.%03ld,\"level\":\"%s\",\"msg\":\"%s\"}\n",
+                          (long long)now.tv_sec, now.tv_nsec / 1000000, levelName, escaped);
+    return length < 0 ? 0 : ((size_t)length < size ? (size_t)length : size - 1);
+}
+
+// Helper function to buffer a formatted record for one stream. Unless wait is set a
+// record that doesn't fit is dropped and counted, otherwise it waits for the writer.
+static void logWrite(int stream, const char* record, size_t length, int wait) {
+    pthread_mutex_lock(&logLock);
+    if (!logRunning) {
+        pthread_mutex_unlock(&logLock);
+        fwrite(record, 1, length, stream ? stderr : stdout);
+        return;
+    }
+
+    LogRing* ring = &logRings[stream];
+    while (LOG_RING_SIZE - (ring->head - ring->tail) < length) {
+        if (!wait) {
+            logDropped++;
+            pthread_mutex_unlock(&logLock);
+            return;
+        }
+        pthread_cond_signal(&logWake);
+        pthread_cond_wait(&logSpace, &logLock);
+    }
+
+    size_t offset = ring->head % LOG_RING_SIZE;
+    size_t first = length < LOG_RING_SIZE - offset ? length : LOG_RING_SIZE - offset;
+    memcpy(ring->data + offset, record, first);
+    memcpy(ring->data, record + first, length - first);
+    ring->head += length;
+
+    if (logPending() >= LOG_FLUSH_THRESHOLD) {
+        pthread_cond_signal(&logWake);
+    }
+    pthread_mutex_unlock(&logLock);
+}
+
+// Function to log a printf-style message. Never blocks on output: if the buffer is full
+// the message is dropped and counted.
+void logMessage(LogLevel level, const char* format, ...) {
+    if (!logEnabled(level)) {
+        return;
+    }
+
+    char message[LOG_MESSAGE_MAX];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+
+    char record[LOG_MESSAGE_MAX * 2 + 128];
+    size_t length = logFormat(record, sizeof(record), logLevelName(level), message);
+    if (length > 0) {
+        logWrite(level <= LOG_LEVEL_WARN ? 1 : 0, record, length, 0);
+    }
+}
+
+// Function to print a printf-style result of the program (estimates, job reports) to
+// stdout, in order with the log. Unlike logMessage it isn't filtered by the log level and
+// waits for buffer space rather than dropping the message.
+void logResult(const char* format, ...) {
+    char message[LOG_MESSAGE_MAX];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+
+    char record[LOG_MESSAGE_MAX * 2 + 128];
+    size_t length = logFormat(record, sizeof(record), "result", message);
+    if (length > 0) {
+        logWrite(0, record, length, 1);
+    }
+}
+
+// Function to log an error message followed by the description of errno (like perror)
+void logErrno(const char* message) {
+    int error = errno;
+    logMessage(LOG_LEVEL_ERROR, "%s: %s\n", message, strerror(error));
+}
+
+// Function to flush everything buffered and stop the writer (registered with atexit)
+void logShutdown() {
+    pthread_mutex_lock(&logLock);
+    if (!logRunning) {
+        pthread_mutex_unlock(&logLock);
+        return;
+    }
+    logStopping = 1;
+    pthread_cond_signal(&logWake);
+    pthread_mutex_unlock(&logLock);
+
+    pthread_join(logWriter, NULL);
+
+    pthread_mutex_lock(&logLock);
+    logRunning = 0;
+    logStopping = 0;
+    unsigned long long dropped = logDropped;
+    pthread_mutex_unlock(&logLock);
+
+    for (int i = 0; i < 2; i++) {
+        free(logRings[i].data);
+        logRings[i].data = NULL;
+    }
+
+    if (dropped > 0) {
+        logMessage(LOG_LEVEL_WARN, "Log buffer full, %llu messages dropped\n", dropped);
+    }
+}
+
+// Function to convert a -l argument to a log level (0 on success)
+int parseLogLevel(const char* name, LogLevel* level) {
+    for (LogLevel candidate = LOG_LEVEL_ERROR; candidate <= LOG_LEVEL_VERBOSE; candidate++) {
+        if (strcmp(name, logLevelName(candidate)) == 0) {
+            *level = candidate;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+const char* logLevelName(LogLevel level) {
+    switch (level) {
+        case LOG_LEVEL_ERROR: return "error";
+        case LOG_LEVEL_WARN: return "warn";
+        case LOG_LEVEL_INFO: return "info";
+        case LOG_LEVEL_VERBOSE: return "verbose";
+    }
+    return "unknown";
+}
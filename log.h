@@ -0,0 +1,32 @@
+#ifndef LOG_H
+#define LOG_H
+
+// Diagnostic output levels, in increasing order of detail
+typedef enum {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_VERBOSE
+} LogLevel;
+
+// Messages above this level are discarded before formatting
+extern LogLevel logLevel;
+
+// Function prototypes
+int logInit(LogLevel level, int json);
+
+void logMessage(LogLevel level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+void logResult(const char* format, ...) __attribute__((format(printf, 1, 2)));
+
+void logErrno(const char* message);
+
+void logShutdown();
+
+int parseLogLevel(const char* name, LogLevel* level);
+
+const char* logLevelName(LogLevel level);
+
+#define logEnabled(level) ((level) <= logLevel)
+
+#endif
@@ -0,0 +1,276 @@
+#include "move.h"
+#include "log.h"
+#include "fsio.h"
+#include "hash.h"
+#include "resume.h"
+#include "trace.h"
+#include "timestamp.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+// Helper function to make destinationPath a reflink (copy-on-write clone) of linkSource,
+// with its permissions and modification time (0 on success)
+static int cloneMovedFile(const char* linkSource, const char* destinationPath) {
+#ifdef FICLONE
+    int sourceFile = fsioOpen(linkSource, O_RDONLY, 0);
+    struct stat sourceInfo;
+    if (sourceFile == -1 || fstat(sourceFile, &sourceInfo) == -1) {
+        if (sourceFile != -1) {close(sourceFile);}
+        return 1;
+    }
+    int destinationFile = fsioOpen(destinationPath, O_WRONLY | O_CREAT | O_EXCL, sourceInfo.st_mode & 07777);
+    if (destinationFile == -1) {
+        close(sourceFile);
+        return 1;
+    }
+
+    int result = ioctl(destinationFile, FICLONE, sourceFile) == -1;
+    if (result == 0) {
+        fchmod(destinationFile, sourceInfo.st_mode & 07777);
+        applyModificationTime(destinationFile, &sourceInfo);
+    }
+    close(destinationFile);
+    close(sourceFile);
+    if (result != 0) {
+        int error = errno;
+        fsioUnlink(destinationPath);
+        errno = error;
+    }
+    return result;
+#else
+    (void)linkSource;
+    (void)destinationPath;
+    errno = EOPNOTSUPP;
+    return 1;
+#endif
+}
+
+// Function to put a moved file in place from the copy already in the destination tree.
+// A reflink is tried first, as it shares no more than unchanged data. Otherwise the file
+// is hardlinked, and both names are then the same file until one is replaced: editing
+// either name in place changes the other. Returns 0 on success (errno set on failure).
+int placeMovedFile(const char* linkSource, const char* destinationPath) {
+    if (cloneMovedFile(linkSource, destinationPath) == 0) {
+        return 0;
+    }
+    return fsioLink(linkSource, destinationPath);
+}
+
+// Function to create an (unbuilt) index for each destination root
+MoveIndex* createMoveIndex(char** roots, int numRoots) {
+    MoveIndex* index = (MoveIndex*)malloc(sizeof(MoveIndex));
+    if (index == NULL) {
+        logErrno("Memory allocation error");
+        return NULL;
+    }
+
+    index->roots = (MoveRootIndex*)calloc(numRoots, sizeof(MoveRootIndex));
+    if (index->roots == NULL) {
+        logErrno("Memory allocation error");
+        free(index);
+        return NULL;
+    }
+
+    index->rootPaths = roots;
+    index->numRoots = numRoots;
+    for (int i = 0; i < numRoots; i++) {
+        index->roots[i].root = roots[i];
+    }
+    return index;
+}
+
+// Directories being indexed, from the root down (to notice symbolic link loops)
+typedef struct IndexAncestor {
+    dev_t device;
+    ino_t inode;
+    const struct IndexAncestor* parent;
+} IndexAncestor;
+
+// Helper function to add every regular file below directory to a root's index
+static void indexDirectory(MoveRootIndex* rootIndex, const char* directory, const IndexAncestor* ancestors,
+                           ProgramOptions opts) {
+    DIR* dir = fsioOpenDir(directory);
+    if (dir == NULL) {
+        return;
+    }
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 || isResumeArtifact(entry->d_name)) {
+            continue;
+        }
+        if (entry->d_name[0] == '.' && !opts.optionA) {
+            continue;
+        }
+
+        // Follow symbolic links as readFiles does, so candidates look as they do to the scan
+        struct stat statbuf;
+        if (fstatat(dirfd(dir), entry->d_name, &statbuf, 0) == -1) {
+            continue;
+        }
+
+        if (S_ISDIR(statbuf.st_mode) && opts.optionR) {
+            // A linked directory may lead back to one being indexed
+            const IndexAncestor* ancestor = ancestors;
+            while (ancestor != NULL && (ancestor->device != statbuf.st_dev || ancestor->inode != statbuf.st_ino)) {
+                ancestor = ancestor->parent;
+            }
+            char* path = ancestor == NULL ? fsioJoinPath(directory, entry->d_name) : NULL;
+            if (path != NULL) {
+                IndexAncestor self = {statbuf.st_dev, statbuf.st_ino, ancestors};
+                indexDirectory(rootIndex, path, &self, opts);
+                free(path);
+            }
+        } else if (S_ISREG(statbuf.st_mode) && statbuf.st_size >= MOVE_MIN_SIZE) {
+            MoveCandidate* temp = (MoveCandidate*)realloc(rootIndex->candidates, (rootIndex->numCandidates + 1) * sizeof(MoveCandidate));
+            if (temp == NULL) {
+                logErrno("Memory allocation error");
+                break;
+            }
+            rootIndex->candidates = temp;
+
+            MoveCandidate* candidate = &rootIndex->candidates[rootIndex->numCandidates];
+            candidate->size = statbuf.st_size;
+            candidate->timestamp = statbuf.st_mtim;
+            candidate->path = fsioJoinPath(directory, entry->d_name);
+            if (candidate->path != NULL) {
+                rootIndex->numCandidates++;
+            }
+        }
+    }
+
+    closedir(dir);
+}
+
+// Helper function to order candidates by (size, timestamp)
+static int compareCandidates(const void* a, const void* b) {
+    const MoveCandidate* x = (const MoveCandidate*)a;
+    const MoveCandidate* y = (const MoveCandidate*)b;
+    if (x->size != y->size) {
+        return x->size < y->size ? -1 : 1;
+    }
+    return compareTimestamps(x->timestamp, y->timestamp);
+}
+
+// Helper function to hash a whole file (0 on success)
+static int hashFile(const char* path, off_t size, uint64_t* hash) {
+    int fd = fsioOpen(path, O_RDONLY, 0);
+    if (fd == -1) {
+        return 1;
+    }
+    int result = hashFileRange(fd, 0, size, hash);
+    close(fd);
+    return result;
+}
+
+// Function to find a file already in the destination's root that the source was moved or
+// renamed from, matched by size and modification time (and content hash with -H).
+// Returns a newly allocated path, or NULL if there is none.
+char* findMoveCandidate(MoveIndex* index, const FileInfo* sourceFile, const char* destinationPath, ProgramOptions opts) {
+    if (index == NULL || sourceFile->size < MOVE_MIN_SIZE) {
+        return NULL;
+    }
+
+    int found = findPathRoot(destinationPath, index->rootPaths, index->numRoots);
+    MoveRootIndex* rootIndex = found == -1 ? NULL : &index->roots[found];
+    if (rootIndex == NULL) {
+        return NULL;
+    }
+
+    if (!rootIndex->built) {
+        TRACE_BEGIN("index", rootIndex->root);
+        struct stat rootInfo;
+        if (fsioStat(rootIndex->root, &rootInfo) == 0) {
+            IndexAncestor root = {rootInfo.st_dev, rootInfo.st_ino, NULL};
+            indexDirectory(rootIndex, rootIndex->root, &root, opts);
+        }
+        qsort(rootIndex->candidates, rootIndex->numCandidates, sizeof(MoveCandidate), compareCandidates);
+        rootIndex->built = 1;
+        TRACE_END("index", rootIndex->root);
+    }
+
+    // Binary search for the first candidate of the source's size whose time is within the
+    // destination's modify window of the source's
+    long long window = modifyWindow(rootIndex->root, opts);
+    struct timespec earliest = sourceFile->timestamp;
+    earliest.tv_sec -= window / NANOSECONDS_PER_SECOND;
+    earliest.tv_nsec -= window % NANOSECONDS_PER_SECOND;
+    if (earliest.tv_nsec < 0) {
+        earliest.tv_sec--;
+        earliest.tv_nsec += NANOSECONDS_PER_SECOND;
+    }
+    MoveCandidate key = {sourceFile->size, earliest, NULL};
+    int low = 0;
+    int high = rootIndex->numCandidates;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (compareCandidates(&rootIndex->candidates[middle], &key) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    // Prefer a candidate with the same filename (a move rather than a rename)
+    const char* filename = strrchr(destinationPath, '/');
+    filename = filename ? filename + 1 : destinationPath;
+    MoveCandidate* chosen = NULL;
+    uint64_t sourceHash = 0;
+    int sourceHashed = 0;
+    for (int i = low; i < rootIndex->numCandidates && rootIndex->candidates[i].size == sourceFile->size; i++) {
+        MoveCandidate* candidate = &rootIndex->candidates[i];
+        if (timestampNewer(candidate->timestamp, sourceFile->timestamp, window)) {
+            break;
+        }
+
+        if (opts.optionH) {
+            uint64_t candidateHash;
+            if (!sourceHashed) {
+                if (hashFile(sourceFile->path, sourceFile->size, &sourceHash) != 0) {
+                    return NULL;
+                }
+                sourceHashed = 1;
+            }
+            if (hashFile(candidate->path, candidate->size, &candidateHash) != 0 || candidateHash != sourceHash) {
+                continue;
+            }
+        }
+
+        const char* candidateName = strrchr(candidate->path, '/');
+        candidateName = candidateName ? candidateName + 1 : candidate->path;
+        if (chosen == NULL || strcmp(candidateName, filename) == 0) {
+            chosen = candidate;
+        }
+        if (strcmp(candidateName, filename) == 0) {
+            break;
+        }
+    }
+
+    return chosen ? strdup(chosen->path) : NULL;
+}
+
+// Function to free an index and everything it has collected
+void freeMoveIndex(MoveIndex* index) {
+    if (index == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < index->numRoots; i++) {
+        for (int j = 0; j < index->roots[i].numCandidates; j++) {
+            free(index->roots[i].candidates[j].path);
+        }
+        free(index->roots[i].candidates);
+    }
+    free(index->roots);
+    free(index);
+}
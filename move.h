@@ -0,0 +1,40 @@
+#ifndef MOVE_H
+#define MOVE_H
+#include "options.h"
+#include "utility.h"
+#include <time.h>
+#include <sys/types.h>
+
+// Files smaller than this are cheaper to copy than to search for
+#define MOVE_MIN_SIZE (64 * 1024)
+
+typedef struct {
+    off_t size;
+    struct timespec timestamp;
+    char* path;
+} MoveCandidate;
+
+// Every regular file under one destination root, sorted by (size, timestamp)
+typedef struct {
+    char* root;
+    MoveCandidate* candidates;
+    int numCandidates;
+    int built; // The root is only walked the first time it is searched
+} MoveRootIndex;
+
+typedef struct {
+    MoveRootIndex* roots;
+    char** rootPaths; // The roots as given, matching roots (for findPathRoot)
+    int numRoots;
+} MoveIndex;
+
+// Function prototypes
+MoveIndex* createMoveIndex(char** roots, int numRoots);
+
+char* findMoveCandidate(MoveIndex* index, const FileInfo* sourceFile, const char* destinationPath, ProgramOptions opts);
+
+int placeMovedFile(const char* linkSource, const char* destinationPath);
+
+void freeMoveIndex(MoveIndex* index);
+
+#endif
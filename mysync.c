@@ -1,6 +1,11 @@
 #include "mysync.h"
 #include "options.h"
 #include "utility.h"
+#include "libmysync.h"
+#include "jobs.h"
+#include "budget.h"
+#include "trace.h"
+#include "log.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -13,18 +18,34 @@ int main(int argc, char* argv[]) {
 
     ProgramOptions opts = parseCommandLine(argc, argv);
 
-    if (opts.numDirectories < 2){
+    if (!opts.optionF && opts.numDirectories < 2){
         usage();
         return 1;
     }
     
+    if (logInit(opts.logLevel, opts.optionJ) != 0) {return 1;}
+
+    if (opts.optionT && traceInit(opts.traceFile) != 0) {return 1;}
+
     if (opts.optionV == 1) {debugPrintOptions(opts);}
 
     if (opts.optionV && (opts.optionI || opts.optionO))  {debugPrintRegexPatterns(opts);}
 
-    SyncedContent* content = readFiles(opts.directories, opts.numDirectories, opts);
+    if (opts.optionB) {budgetInit(opts.ioBudget * 1048576.0);}
 
-    if (opts.optionV == 1){debugPrintSyncedContent(content);}
-    
-    return syncFiles(content, opts);
+    if (opts.optionF) {
+        JobList* jobs = readJobFile(opts.jobFile);
+        if (jobs == NULL) {return 1;}
+        int result = runJobs(jobs, opts.numWorkers);
+        freeJobList(jobs);
+        return result;
+    }
+
+    MysyncContext* context = mysyncCreate(opts);
+    if (context == NULL) {return 1;}
+
+    int result = mysyncSync(context);
+    if (result != MYSYNC_DEFERRED) {result = result != 0;}
+    mysyncDestroy(context);
+    return result;
 }
@@ -1,5 +1,7 @@
 #include "options.h"
+#include "log.h"
 #include "utility.h"
+#include "plan.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -8,17 +10,22 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+// Largest modify window accepted by -g, in seconds (one day)
+#define MAX_MODIFY_WINDOW 86400
 
-
-ProgramOptions parseCommandLine(int argc, char* argv[]) {
+// Function to parse a command line into *result without exiting: on an error (reported
+// through the log) everything allocated is freed and 1 is returned
+int parseOptions(int argc, char* argv[], ProgramOptions* result) {
     // Initialise options
-    ProgramOptions opts = {0, 0, 0, 0, 0, 0, 0, NULL, 0, NULL, 0};
+    ProgramOptions opts = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, NULL, 0, NULL, 0, NULL, 0, NULL, ORDER_NONE, LOG_LEVEL_INFO, NULL, NULL, NULL, 0, 4, 0, 1, 0};
     int opt;
     
-    // Initialise
+    // Fully reinitialise getopt (0 rather than 1 for glibc), as it may have been used
+    // before: by libmysync callers, or for the previous line of a job file
+    optind = 0;
 
     // Parse - Options
-    while ((opt = getopt(argc, argv, "anpvri:o:")) != -1) {
+    while ((opt = getopt(argc, argv, "anpvri:o:T:cHs:l:jmf:b:u:w:d:g:")) != -1) {
         switch (opt) {
             case 'a':
                 opts.optionA = 1;
@@ -40,14 +47,14 @@ ProgramOptions parseCommandLine(int argc, char* argv[]) {
                 opts.optionI = 1;
                 char** newIgnorePatterns = realloc(opts.ignorePatterns, (opts.numIgnorePatterns + 1) * sizeof(char*));
                 if (!newIgnorePatterns) {
-                    perror("Memory allocation error for ignore patterns");
-                    exit(EXIT_FAILURE);
+                    logErrno("Memory allocation error for ignore patterns");
+                    goto fail;
                 }
                 opts.ignorePatterns = newIgnorePatterns;
                 opts.ignorePatterns[opts.numIgnorePatterns] = glob2regex(optarg);  
                 if (!opts.ignorePatterns[opts.numIgnorePatterns]) {
-                    perror("Error converting glob to regex for ignore patterns");
-                    exit(EXIT_FAILURE);
+                    logErrno("Error converting glob to regex for ignore patterns");
+                    goto fail;
                 }
                 opts.numIgnorePatterns++;
                 break;
@@ -55,25 +62,110 @@ ProgramOptions parseCommandLine(int argc, char* argv[]) {
                 opts.optionO = 1;
                 char** newConsiderPatterns = realloc(opts.considerPatterns, (opts.numConsiderPatterns + 1) * sizeof(char*));
                 if (!newConsiderPatterns) {
-                    perror("Memory allocation error for consider patterns");
-                    exit(EXIT_FAILURE);
+                    logErrno("Memory allocation error for consider patterns");
+                    goto fail;
                 }
                 opts.considerPatterns = newConsiderPatterns;
                 opts.considerPatterns[opts.numConsiderPatterns] = glob2regex(optarg); 
                 if (!opts.considerPatterns[opts.numConsiderPatterns]) {
-                    perror("Error converting glob to regex for consider patterns");
-                    exit(EXIT_FAILURE);
+                    logErrno("Error converting glob to regex for consider patterns");
+                    goto fail;
                 }
                 opts.numConsiderPatterns++;
                 break;
-            
+            case 'T':
+                opts.optionT = 1;
+                opts.traceFile = optarg;
+                break;
+            case 'c':
+                opts.optionC = 1;
+                break;
+            case 'H':
+                opts.optionH = 1;
+                break;
+            case 's':
+                opts.optionS = 1;
+                if (parseCopyOrder(optarg, &opts.copyOrder) != 0) {
+                    logMessage(LOG_LEVEL_ERROR, "Error: unknown copy order %s (expected none, inode, extent or size).\n", optarg);
+                    goto fail;
+                }
+                break;
+            case 'l':
+                opts.optionL = 1;
+                if (parseLogLevel(optarg, &opts.logLevel) != 0) {
+                    logMessage(LOG_LEVEL_ERROR, "Error: unknown log level %s (expected error, warn, info or verbose).\n", optarg);
+                    goto fail;
+                }
+                break;
+            case 'j':
+                opts.optionJ = 1;
+                break;
+            case 'm':
+                opts.optionM = 1;
+                break;
+            case 'f':
+                opts.optionF = 1;
+                opts.jobFile = optarg;
+                break;
+            case 'b':
+                opts.optionB = 1;
+                opts.ioBudget = atoi(optarg);
+                if (opts.ioBudget <= 0) {
+                    logMessage(LOG_LEVEL_ERROR, "Error: invalid I/O budget %s (expected MiB/s above 0).\n", optarg);
+                    goto fail;
+                }
+                break;
+            case 'u':
+                opts.optionU = 1;
+                opts.numWorkers = atoi(optarg);
+                if (opts.numWorkers <= 0) {
+                    logMessage(LOG_LEVEL_ERROR, "Error: invalid worker count %s.\n", optarg);
+                    goto fail;
+                }
+                break;
+            case 'w':
+                opts.optionW = 1;
+                opts.window = atoi(optarg);
+                if (opts.window <= 0) {
+                    logMessage(LOG_LEVEL_ERROR, "Error: invalid time window %s (expected seconds above 0).\n", optarg);
+                    goto fail;
+                }
+                break;
+            case 'd':
+                opts.optionD = 1;
+                opts.deviceConcurrency = atoi(optarg);
+                if (opts.deviceConcurrency <= 0) {
+                    logMessage(LOG_LEVEL_ERROR, "Error: invalid device concurrency %s.\n", optarg);
+                    goto fail;
+                }
+                break;
+            case 'g': {
+                opts.optionG = 1;
+                char* end;
+                double seconds = strtod(optarg, &end);
+                // Written so that NaN fails too
+                if (end == optarg || *end != '\0' || !(seconds >= 0 && seconds <= MAX_MODIFY_WINDOW)) {
+                    logMessage(LOG_LEVEL_ERROR, "Error: invalid modify window %s (expected 0 to %d seconds).\n",
+                               optarg, MAX_MODIFY_WINDOW);
+                    goto fail;
+                }
+                opts.modifyWindow = (long long)(seconds * 1e9);
+                break;
+            }
+            default:
+                // An unknown option or a missing argument, already reported by getopt
+                goto fail;
+
         }
     }
 
-    // Parse / Validate Directories
-    int numDirectories = 0;
-    char** directories = NULL;
+    // An explicit log level (-l) overrides -v / -n, verbose output follows the level
+    if (!opts.optionL) {
+        opts.logLevel = opts.optionV ? LOG_LEVEL_VERBOSE : LOG_LEVEL_INFO;
+    }
+    opts.optionV = opts.logLevel >= LOG_LEVEL_VERBOSE;
 
+    // Parse / Validate Directories (stored as they are found, so a failure frees them)
     for (int i = optind; i < argc; i++) {
         int pathType = validatePath(argv[i]);
         if (pathType == 1) {
@@ -81,40 +173,62 @@ ProgramOptions parseCommandLine(int argc, char* argv[]) {
             char* path_copy = strdup(argv[i]);
             if (path_copy == NULL) {
                 // Handle memory allocation error
-                perror("Memory allocation error");
-                // Free previously allocated memory
-                for (int j = 0; j < numDirectories; j++) {
-                    free(directories[j]);
-                }
-                free(directories);
-                exit(1); // Exit with an error
+                logErrno("Memory allocation error");
+                goto fail;
             }
 
-            char** temp = realloc(directories, (numDirectories + 1) * sizeof(char*));
+            char** temp = realloc(opts.directories, (opts.numDirectories + 1) * sizeof(char*));
             if (temp == NULL) {
                 // Handle memory reallocation error
-                perror("Memory reallocation error");
+                logErrno("Memory reallocation error");
                 free(path_copy); // Free the path_copy
-                // Free previously allocated memory
-                for (int j = 0; j < numDirectories; j++) {
-                    free(directories[j]);
-                }
-                free(directories);
-                exit(1); // Exit with an error
+                goto fail;
             }
 
-            directories = temp;
-            directories[numDirectories] = path_copy;
-            numDirectories++;
+            opts.directories = temp;
+            opts.directories[opts.numDirectories] = path_copy;
+            opts.numDirectories++;
         } else {
-            fprintf(stderr, "Error: %s is not a valid directory path.\n", argv[i]);
-            exit(1); // Exit with an error
+            logMessage(LOG_LEVEL_ERROR, "Error: %s is not a valid directory path.\n", argv[i]);
+            goto fail;
         }
     }
 
-    // Update the 'opts' structure with the 'directories' and 'numDirectories'
-    opts.directories = directories;
-    opts.numDirectories = numDirectories;
+    *result = opts;
+    return 0;
+
+fail:
+    freeProgramOptions(&opts);
+    return 1;
+}
 
+// Function to parse the command line, exiting with status 1 on an error
+ProgramOptions parseCommandLine(int argc, char* argv[]) {
+    ProgramOptions opts;
+    if (parseOptions(argc, argv, &opts) != 0) {
+        exit(1); // Exit with an error
+    }
     return opts;
-}
\ No newline at end of file
+}
+
+// Function to free the patterns and directories allocated by parseOptions
+void freeProgramOptions(ProgramOptions* opts) {
+    for (int i = 0; i < opts->numIgnorePatterns; i++) {
+        free(opts->ignorePatterns[i]);
+    }
+    free(opts->ignorePatterns);
+    opts->ignorePatterns = NULL;
+    opts->numIgnorePatterns = 0;
+    for (int i = 0; i < opts->numConsiderPatterns; i++) {
+        free(opts->considerPatterns[i]);
+    }
+    free(opts->considerPatterns);
+    opts->considerPatterns = NULL;
+    opts->numConsiderPatterns = 0;
+    for (int i = 0; i < opts->numDirectories; i++) {
+        free(opts->directories[i]);
+    }
+    free(opts->directories);
+    opts->directories = NULL;
+    opts->numDirectories = 0;
+}
@@ -1,5 +1,15 @@
 #ifndef OPTIONS_H
 #define OPTIONS_H
+#include "log.h"
+#include <regex.h>
+
+// Order in which planned copies are performed (-s)
+typedef enum {
+    ORDER_NONE,   // readdir order
+    ORDER_INODE,  // source inode number
+    ORDER_EXTENT, // source's first physical extent (FIEMAP), falls back to inode
+    ORDER_SIZE    // smallest files first
+} CopyOrder;
 
 typedef struct {
     int optionA; //hidden files
@@ -9,6 +19,19 @@ typedef struct {
     int optionR; // recursive
     int optionI; // Ignore matching
     int optionO; // Match with 
+    int optionT; // Trace timeline
+    int optionC; // Resumable (checkpointed) copies
+    int optionH; // Verify with content hashes
+    int optionS; // Copy ordering policy set
+    int optionL; // Log level set
+    int optionJ; // JSON-lines log output
+    int optionM; // Move / rename detection
+    int optionF; // Job file
+    int optionB; // Global I/O budget
+    int optionU; // Worker count set
+    int optionW; // Time window set
+    int optionD; // Per-device concurrency set
+    int optionG; // Modify window set
     
     char** ignorePatterns; // Stores regex data
     int numIgnorePatterns;
@@ -16,9 +39,24 @@ typedef struct {
     int numConsiderPatterns;
     char** directories;
     int numDirectories;
+    char* traceFile; // Chrome trace-event output (-T)
+    CopyOrder copyOrder;
+    LogLevel logLevel;
+    regex_t* ignoreRegexes; // ignorePatterns compiled once (compilePatterns)
+    regex_t* considerRegexes; // considerPatterns compiled once
+    char* jobFile; // File listing sync sets to run together (-f)
+    int ioBudget; // Combined copy rate limit in MiB/s (-b), 0 for none
+    int numWorkers; // Jobs run concurrently in job file mode (-u)
+    int window; // Seconds a sync may take before it is deferred (-w)
+    int deviceConcurrency; // Copies at a time reading or writing each device (-d)
+    long long modifyWindow; // Nanoseconds by which times may differ and still match (-g)
     
 } ProgramOptions;
 
+int parseOptions(int argc, char* argv[], ProgramOptions* result);
+
 ProgramOptions parseCommandLine(int argc, char* argv[]);
 
+void freeProgramOptions(ProgramOptions* opts);
+
 #endif
@@ -0,0 +1,89 @@
+#include "pipeline.h"
+#include "log.h"
+#include "trace.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Copies batches of a plan while planning continues. Every batch goes to one executor,
+// whose device queues keep copying for the whole run, so a slow queue only holds up its
+// own device. Submitting waits while too many copies are pending (PLAN_PENDING_LIMIT).
+struct SyncPipeline {
+    ProgramOptions opts;
+    SyncExecutor* executor;
+    SyncPlan** batches; // Submitted batches, kept until finished (the executor uses them)
+    int numBatches;
+};
+
+// Function to start a pipeline copying with the given options and resources
+SyncPipeline* startSyncPipeline(ProgramOptions opts, SyncResources* resources) {
+    SyncPipeline* pipeline = (SyncPipeline*)calloc(1, sizeof(SyncPipeline));
+    if (pipeline == NULL) {
+        logErrno("Memory allocation error");
+        return NULL;
+    }
+
+    pipeline->opts = opts;
+    pipeline->executor = startSyncExecutor(opts, resources);
+    if (pipeline->executor == NULL) {
+        free(pipeline);
+        return NULL;
+    }
+    return pipeline;
+}
+
+// Function to order a batch and queue it for copying (a SyncPlanSink, taking ownership)
+int submitSyncBatch(SyncPlan* batch, void* data) {
+    SyncPipeline* pipeline = (SyncPipeline*)data;
+
+    SyncPlan** temp = (SyncPlan**)realloc(pipeline->batches, (pipeline->numBatches + 1) * sizeof(SyncPlan*));
+    if (temp == NULL) {
+        logErrno("Memory allocation error");
+        freeSyncPlan(batch);
+        return 1;
+    }
+    pipeline->batches = temp;
+    pipeline->batches[pipeline->numBatches++] = batch;
+
+    if (pipeline->opts.optionS) {
+        orderSyncPlan(batch, pipeline->opts.copyOrder);
+    }
+    TRACE_BEGIN("batch", batch->operations[0].destinationPath);
+    submitSyncPlan(pipeline->executor, batch);
+    TRACE_END("batch", batch->operations[0].destinationPath);
+    return 0;
+}
+
+// Function to wait for every submitted batch to be copied and free the pipeline. The
+// executed operations are returned in *executed (NULL if they couldn't be gathered).
+// Returns the number of failed copies.
+int finishSyncPipeline(SyncPipeline* pipeline, SyncPlan** executed) {
+    int failures = finishSyncExecutor(pipeline->executor);
+
+    // Gather the batches' operations into one plan, for recording rates
+    int numOperations = 0;
+    for (int b = 0; b < pipeline->numBatches; b++) {
+        numOperations += pipeline->batches[b]->numOperations;
+    }
+    *executed = createSyncPlan();
+    CopyOperation* operations = numOperations > 0 ? (CopyOperation*)malloc((size_t)numOperations * sizeof(CopyOperation)) : NULL;
+    if (*executed != NULL && operations != NULL) {
+        for (int b = 0; b < pipeline->numBatches; b++) {
+            SyncPlan* batch = pipeline->batches[b];
+            memcpy(operations + (*executed)->numOperations, batch->operations, (size_t)batch->numOperations * sizeof(CopyOperation));
+            (*executed)->numOperations += batch->numOperations;
+            free(batch->operations);
+            batch->operations = NULL;
+            batch->numOperations = 0;
+        }
+        (*executed)->operations = operations;
+    } else {
+        free(operations);
+    }
+
+    for (int b = 0; b < pipeline->numBatches; b++) {
+        freeSyncPlan(pipeline->batches[b]);
+    }
+    free(pipeline->batches);
+    free(pipeline);
+    return failures;
+}
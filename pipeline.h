@@ -0,0 +1,15 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+#include "options.h"
+#include "plan.h"
+
+typedef struct SyncPipeline SyncPipeline;
+
+// Function prototypes
+SyncPipeline* startSyncPipeline(ProgramOptions opts, SyncResources* resources);
+
+int submitSyncBatch(SyncPlan* batch, void* pipeline);
+
+int finishSyncPipeline(SyncPipeline* pipeline, SyncPlan** executed);
+
+#endif
@@ -0,0 +1,856 @@
+#include "plan.h"
+#include "log.h"
+#include "utility.h"
+#include "fsio.h"
+#include "fanout.h"
+#include "trace.h"
+#include "move.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+
+// Sort key for files whose physical location is unknown (placed after located files)
+#define PHYSICAL_UNKNOWN UINT64_MAX
+
+// Function to create an empty plan
+SyncPlan* createSyncPlan() {
+    SyncPlan* plan = (SyncPlan*)malloc(sizeof(SyncPlan));
+    if (plan == NULL) {
+        logErrno("Memory allocation error");
+        return NULL;
+    }
+
+    plan->operations = NULL;
+    plan->numOperations = 0;
+    plan->directories = NULL;
+    plan->directorySources = NULL;
+    plan->numDirectories = 0;
+    plan->deferDirectories = 0;
+    plan->sink = NULL;
+    plan->sinkData = NULL;
+    return plan;
+}
+
+// Function to append a pending copy to the plan
+int addCopyOperation(SyncPlan* plan, const char* sourcePath, const char* destinationPath, int isUpdate,
+                     off_t size, dev_t device, ino_t inode, const char* linkSource) {
+    CopyOperation operation;
+    operation.sourcePath = strdup(sourcePath);
+    operation.destinationPath = strdup(destinationPath);
+    operation.linkSource = linkSource ? strdup(linkSource) : NULL;
+    operation.isUpdate = isUpdate;
+    operation.size = size;
+    operation.device = device;
+    operation.inode = inode;
+    operation.physical = PHYSICAL_UNKNOWN;
+    operation.sequence = plan->numOperations;
+    operation.seconds = 0;
+    operation.result = 1;
+
+    CopyOperation* temp = (CopyOperation*)realloc(plan->operations, (plan->numOperations + 1) * sizeof(CopyOperation));
+    if (temp == NULL || operation.sourcePath == NULL || operation.destinationPath == NULL) {
+        logErrno("Memory allocation error");
+        free(operation.sourcePath);
+        free(operation.destinationPath);
+        free(operation.linkSource);
+        if (temp != NULL) {plan->operations = temp;}
+        return 1;
+    }
+
+    plan->operations = temp;
+    plan->operations[plan->numOperations] = operation;
+    plan->numOperations++;
+    return 0;
+}
+
+// Function to record a destination directory created during planning (or to be created)
+int addDirectoryOperation(SyncPlan* plan, const char* path, const char* sourcePath) {
+    char* copy = strdup(path);
+    char* sourceCopy = strdup(sourcePath);
+    char** temp = (char**)realloc(plan->directories, (plan->numDirectories + 1) * sizeof(char*));
+    if (temp != NULL) {plan->directories = temp;}
+    char** sourceTemp = (char**)realloc(plan->directorySources, (plan->numDirectories + 1) * sizeof(char*));
+    if (sourceTemp != NULL) {plan->directorySources = sourceTemp;}
+    if (temp == NULL || sourceTemp == NULL || copy == NULL || sourceCopy == NULL) {
+        logErrno("Memory allocation error");
+        free(copy);
+        free(sourceCopy);
+        return 1;
+    }
+
+    plan->directories[plan->numDirectories] = copy;
+    plan->directorySources[plan->numDirectories] = sourceCopy;
+    plan->numDirectories++;
+    return 0;
+}
+
+// Function to hand the operations planned so far to the plan's sink as a batch (if it
+// has one), leaving the plan empty. Returns the sink's result.
+int flushSyncPlan(SyncPlan* plan) {
+    if (plan->sink == NULL || plan->numOperations == 0) {
+        return 0;
+    }
+
+    SyncPlan* batch = createSyncPlan();
+    if (batch == NULL) {
+        return 1;
+    }
+    batch->operations = plan->operations;
+    batch->numOperations = plan->numOperations;
+    plan->operations = NULL;
+    plan->numOperations = 0;
+    return plan->sink(batch, plan->sinkData);
+}
+
+// Helper function to find the physical offset of a file's first extent via FIEMAP (0 on success)
+static int firstPhysicalExtent(const char* path, uint64_t* physical) {
+#ifdef __linux__
+    int fd = fsioOpen(path, O_RDONLY, 0);
+    if (fd == -1) {
+        return 1;
+    }
+
+    // Room for the header and a single extent
+    struct fiemap* map = (struct fiemap*)calloc(1, sizeof(struct fiemap) + sizeof(struct fiemap_extent));
+    if (map == NULL) {
+        close(fd);
+        return 1;
+    }
+    map->fm_start = 0;
+    map->fm_length = FIEMAP_MAX_OFFSET;
+    map->fm_extent_count = 1;
+
+    int result = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, map) == 0 && map->fm_mapped_extents > 0) {
+        *physical = map->fm_extents[0].fe_physical;
+        result = 0;
+    }
+
+    free(map);
+    close(fd);
+    return result;
+#else
+    (void)path;
+    (void)physical;
+    return 1;
+#endif
+}
+
+// Helper function to compare two unsigned keys for qsort
+static int compareKeys(uint64_t a, uint64_t b) {
+    return (a > b) - (a < b);
+}
+
+static int compareBySequence(const void* a, const void* b) {
+    const CopyOperation* x = (const CopyOperation*)a;
+    const CopyOperation* y = (const CopyOperation*)b;
+    return compareKeys(x->sequence, y->sequence);
+}
+
+static int compareByInode(const void* a, const void* b) {
+    const CopyOperation* x = (const CopyOperation*)a;
+    const CopyOperation* y = (const CopyOperation*)b;
+    int result = compareKeys(x->device, y->device);
+    if (result == 0) {result = compareKeys(x->inode, y->inode);}
+    if (result == 0) {result = compareKeys(x->sequence, y->sequence);}
+    return result;
+}
+
+static int compareByExtent(const void* a, const void* b) {
+    const CopyOperation* x = (const CopyOperation*)a;
+    const CopyOperation* y = (const CopyOperation*)b;
+    int result = compareKeys(x->device, y->device);
+    if (result == 0) {result = compareKeys(x->physical, y->physical);}
+    if (result == 0) {result = compareKeys(x->inode, y->inode);}
+    if (result == 0) {result = compareKeys(x->sequence, y->sequence);}
+    return result;
+}
+
+static int compareBySize(const void* a, const void* b) {
+    const CopyOperation* x = (const CopyOperation*)a;
+    const CopyOperation* y = (const CopyOperation*)b;
+    int result = compareKeys(x->size, y->size);
+    if (result == 0) {result = compareByInode(a, b);}
+    return result;
+}
+
+// Function to reorder the pending copies to follow the source's physical layout (or size)
+void orderSyncPlan(SyncPlan* plan, CopyOrder order) {
+    if (plan->numOperations < 2) {
+        return;
+    }
+
+    switch (order) {
+        case ORDER_NONE:
+            qsort(plan->operations, plan->numOperations, sizeof(CopyOperation), compareBySequence);
+            break;
+        case ORDER_INODE:
+            qsort(plan->operations, plan->numOperations, sizeof(CopyOperation), compareByInode);
+            break;
+        case ORDER_EXTENT:
+            // Copies of the same source share its extent, so only look each one up once
+            for (int i = 0; i < plan->numOperations; i++) {
+                CopyOperation* operation = &plan->operations[i];
+                if (i > 0 && strcmp(plan->operations[i - 1].sourcePath, operation->sourcePath) == 0) {
+                    operation->physical = plan->operations[i - 1].physical;
+                } else if (firstPhysicalExtent(operation->sourcePath, &operation->physical) != 0) {
+                    operation->physical = PHYSICAL_UNKNOWN;
+                }
+            }
+            qsort(plan->operations, plan->numOperations, sizeof(CopyOperation), compareByExtent);
+            break;
+        case ORDER_SIZE:
+            qsort(plan->operations, plan->numOperations, sizeof(CopyOperation), compareBySize);
+            break;
+    }
+}
+
+// Copies of one source made together, reading it once: all its destinations in a batch
+typedef struct DeviceQueue DeviceQueue;
+typedef struct {
+    DeviceQueue* queue;
+    CopyOperation** operations;
+    int numOperations;
+    int sequence;   // Position of its first copy in the submitted batch
+    dev_t* devices; // Devices it reads and writes, the source's first
+    int numDevices;
+} CopyTask;
+
+// Copies reading from one source device, in submission order
+struct DeviceQueue {
+    dev_t device;
+    CopyTask* tasks;
+    int numTasks;
+    int maxTasks;   // Allocated size of tasks
+    int next;       // First task not claimed yet
+    int numWorkers; // Threads started for it (0: the submitting thread drains it)
+    pthread_cond_t notEmpty;
+};
+
+typedef struct {
+    SyncExecutor* executor;
+    DeviceQueue* queue;
+    FanOutWorkspace* workspace; // Fan-out buffers and writers to reuse (NULL for temporary ones)
+    pthread_t thread;
+} QueueWorker;
+
+// Copies submitted batch by batch to device queues whose workers run until finished
+struct SyncExecutor {
+    ProgramOptions opts;
+    SyncResources* resources;
+    SyncResources local;  // Holds the workspaces when there are no resources
+    DeviceQueue** queues; // Pointers, so the queues don't move as more are added
+    int numQueues;
+    QueueWorker** workers;
+    int numWorkers;
+    int pending;          // Copies submitted and not finished yet
+    int finishing;        // No more batches will be submitted
+    SyncProgress progress;
+    int failures;
+    pthread_mutex_t lock;
+    pthread_cond_t progressed; // A copy finished
+};
+
+// Copies in progress on each device, across every executor of the process (job file sets
+// included), so a device is never read or written by more than -d copies at a time
+typedef struct {
+    dev_t device;
+    int users;
+} DeviceUse;
+
+static DeviceUse* deviceUses = NULL;
+static int numDeviceUses = 0;
+static pthread_mutex_t deviceUseLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t deviceUseReleased = PTHREAD_COND_INITIALIZER;
+
+// Helper function to find a device's use count, adding it the first time (lock held).
+// NULL if out of memory, and the device is then not limited.
+static DeviceUse* findDeviceUse(dev_t device) {
+    for (int i = 0; i < numDeviceUses; i++) {
+        if (deviceUses[i].device == device) {
+            return &deviceUses[i];
+        }
+    }
+    DeviceUse* temp = (DeviceUse*)realloc(deviceUses, (numDeviceUses + 1) * sizeof(DeviceUse));
+    if (temp == NULL) {
+        return NULL;
+    }
+    deviceUses = temp;
+    deviceUses[numDeviceUses].device = device;
+    deviceUses[numDeviceUses].users = 0;
+    return &deviceUses[numDeviceUses++];
+}
+
+// Helper function to wait until every device of a copy has fewer than limit copies in
+// progress, then count it on all of them at once (so waiting copies can't deadlock)
+static void acquireDevices(const dev_t* devices, int numDevices, int limit) {
+    pthread_mutex_lock(&deviceUseLock);
+    while (1) {
+        int available = 1;
+        for (int d = 0; d < numDevices && available; d++) {
+            DeviceUse* use = findDeviceUse(devices[d]);
+            available = use == NULL || use->users < limit;
+        }
+        if (available) {
+            break;
+        }
+        pthread_cond_wait(&deviceUseReleased, &deviceUseLock);
+    }
+    for (int d = 0; d < numDevices; d++) {
+        DeviceUse* use = findDeviceUse(devices[d]);
+        if (use != NULL) {use->users++;}
+    }
+    pthread_mutex_unlock(&deviceUseLock);
+}
+
+// Helper function to uncount a finished copy from its devices
+static void releaseDevices(const dev_t* devices, int numDevices) {
+    pthread_mutex_lock(&deviceUseLock);
+    for (int d = 0; d < numDevices; d++) {
+        DeviceUse* use = findDeviceUse(devices[d]);
+        if (use != NULL && use->users > 0) {use->users--;}
+    }
+    pthread_cond_broadcast(&deviceUseReleased);
+    pthread_mutex_unlock(&deviceUseLock);
+}
+
+// Helper function to count a finished destination and pass it to the progress callback
+// (called with the executor's lock held, so callbacks are never concurrent). Linked
+// destinations (-m) were put in place without writing their data.
+static void reportProgress(SyncExecutor* executor, CopyOperation* operation, int result, int linked) {
+    SyncProgress* progress = &executor->progress;
+    operation->result = result;
+    progress->operationsDone++;
+    progress->bytesDone += operation->size;
+    if (result == 0 && !linked) {
+        progress->bytesCopied += operation->size;
+    }
+    progress->sourcePath = operation->sourcePath;
+    progress->destinationPath = operation->destinationPath;
+    progress->result = result;
+    if (result != 0) {
+        executor->failures++;
+    }
+
+    SyncResources* resources = executor->resources;
+    if (resources != NULL && resources->progress != NULL) {
+        resources->progress(progress, resources->progressData);
+    }
+}
+
+// Function to find the device a destination will be written to: its directory's, or the
+// nearest existing ancestor's when the directory hasn't been made yet (-n). The last
+// directory looked up is kept in *lastDirectory (freed by the caller) to skip repeats.
+dev_t planDestinationDevice(const char* destinationPath, char** lastDirectory, dev_t* lastDevice) {
+    const char* slash = strrchr(destinationPath, '/');
+    size_t length = slash != NULL ? (size_t)(slash - destinationPath) : 0;
+    char* directory = length > 0 ? strndup(destinationPath, length) : strdup(slash != NULL ? "/" : ".");
+    if (directory == NULL) {
+        return 0;
+    }
+
+    // Consecutive operations usually share a directory
+    if (*lastDirectory != NULL && strcmp(*lastDirectory, directory) == 0) {
+        free(directory);
+        return *lastDevice;
+    }
+    free(*lastDirectory);
+    *lastDirectory = directory;
+
+    char* ancestor = strdup(directory);
+    struct stat info;
+    *lastDevice = 0;
+    while (ancestor != NULL) {
+        if (fsioStat(ancestor, &info) == 0) {
+            *lastDevice = info.st_dev;
+            break;
+        }
+        char* parent = strrchr(ancestor, '/');
+        if (parent == NULL || parent == ancestor) {
+            break;
+        }
+        *parent = '\0';
+    }
+    free(ancestor);
+    return *lastDevice;
+}
+
+
+// Helper function to copy one source to its destinations on a queue and record the results
+static void runCopyTask(SyncExecutor* executor, CopyTask* task, FanOutWorkspace* workspace) {
+    int numDestinations = task->numOperations;
+    char** destinations = (char**)malloc((size_t)numDestinations * sizeof(char*));
+    int* results = (int*)malloc((size_t)numDestinations * sizeof(int));
+    double seconds = 0;
+
+    if (destinations == NULL || results == NULL) {
+        logErrno("Memory allocation error");
+        free(results);
+        results = NULL;
+    } else {
+        for (int k = 0; k < numDestinations; k++) {
+            destinations[k] = task->operations[k]->destinationPath;
+        }
+        int limit = executor->opts.deviceConcurrency > 0 ? executor->opts.deviceConcurrency : 1;
+        acquireDevices(task->devices, task->numDevices, limit);
+        double start = monotonicSeconds();
+        copyFileFanOut(task->operations[0]->sourcePath, destinations, numDestinations, executor->opts, results, workspace);
+        // The destinations were written concurrently, so each of them took the whole time
+        seconds = monotonicSeconds() - start;
+        releaseDevices(task->devices, task->numDevices);
+    }
+
+    pthread_mutex_lock(&executor->lock);
+    for (int k = 0; k < numDestinations; k++) {
+        task->operations[k]->seconds = seconds;
+        reportProgress(executor, task->operations[k], results != NULL ? results[k] : 1, 0);
+    }
+    executor->pending -= numDestinations;
+    pthread_cond_broadcast(&executor->progressed);
+    pthread_mutex_unlock(&executor->lock);
+
+    free(destinations);
+    free(results);
+    free(task->operations);
+    free(task->devices);
+}
+
+// Helper function to perform a queue's tasks in order. With wait, more tasks are waited
+// for until the executor finishes; otherwise it returns once the queue is empty.
+static void runQueue(SyncExecutor* executor, DeviceQueue* queue, FanOutWorkspace* workspace, int wait) {
+    pthread_mutex_lock(&executor->lock);
+    while (1) {
+        while (wait && queue->next == queue->numTasks && !executor->finishing) {
+            pthread_cond_wait(&queue->notEmpty, &executor->lock);
+        }
+        if (queue->next == queue->numTasks) {
+            break;
+        }
+        CopyTask task = queue->tasks[queue->next++];
+        pthread_mutex_unlock(&executor->lock);
+
+        runCopyTask(executor, &task, workspace);
+        pthread_mutex_lock(&executor->lock);
+    }
+    pthread_mutex_unlock(&executor->lock);
+}
+
+// Helper function run by each queue worker thread
+static void* queueWorkerMain(void* arg) {
+    QueueWorker* worker = (QueueWorker*)arg;
+    runQueue(worker->executor, worker->queue, worker->workspace, 1);
+    return NULL;
+}
+
+// Helper function to give the next worker of the run a workspace, kept in the resources
+// for later executions (NULL if none could be made, for temporary ones)
+static FanOutWorkspace* workerWorkspace(SyncExecutor* executor, int w) {
+    SyncResources* owner = executor->resources != NULL ? executor->resources : &executor->local;
+    if (w >= owner->numWorkspaces) {
+        FanOutWorkspace** temp = (FanOutWorkspace**)realloc(owner->workspaces, (w + 1) * sizeof(FanOutWorkspace*));
+        if (temp == NULL) {
+            return NULL;
+        }
+        owner->workspaces = temp;
+        while (owner->numWorkspaces <= w) {
+            owner->workspaces[owner->numWorkspaces++] = NULL;
+        }
+    }
+    if (owner->workspaces[w] == NULL) {
+        owner->workspaces[w] = createFanOutWorkspace();
+    }
+    return owner->workspaces[w];
+}
+
+// Helper function to find the queue for a source device, adding it and starting its
+// workers (opts.deviceConcurrency of them) the first time. NULL if out of memory.
+static DeviceQueue* findDeviceQueue(SyncExecutor* executor, dev_t device) {
+    for (int q = 0; q < executor->numQueues; q++) {
+        DeviceQueue* queue = executor->queues[q];
+        if (queue->device == device) {
+            return queue;
+        }
+    }
+
+    int concurrency = executor->opts.deviceConcurrency > 0 ? executor->opts.deviceConcurrency : 1;
+    DeviceQueue** queues = (DeviceQueue**)realloc(executor->queues, (executor->numQueues + 1) * sizeof(DeviceQueue*));
+    QueueWorker** workers = NULL;
+    if (queues != NULL) {
+        executor->queues = queues;
+        workers = (QueueWorker**)realloc(executor->workers, (executor->numWorkers + concurrency) * sizeof(QueueWorker*));
+    }
+    DeviceQueue* queue = (DeviceQueue*)calloc(1, sizeof(DeviceQueue));
+    if (queues == NULL || workers == NULL || queue == NULL) {
+        logErrno("Memory allocation error");
+        free(queue);
+        return NULL;
+    }
+    executor->workers = workers;
+    queue->device = device;
+    pthread_cond_init(&queue->notEmpty, NULL);
+    executor->queues[executor->numQueues++] = queue;
+
+    for (int c = 0; c < concurrency; c++) {
+        QueueWorker* worker = (QueueWorker*)calloc(1, sizeof(QueueWorker));
+        if (worker == NULL) {
+            break;
+        }
+        worker->executor = executor;
+        worker->queue = queue;
+        worker->workspace = workerWorkspace(executor, executor->numWorkers);
+        if (pthread_create(&worker->thread, NULL, queueWorkerMain, worker) != 0) {
+            free(worker);
+            break;
+        }
+        executor->workers[executor->numWorkers++] = worker;
+        queue->numWorkers++;
+    }
+    if (queue->numWorkers == 0) {
+        logMessage(LOG_LEVEL_WARN, "Could not start a copy thread, copying while planning\n");
+    }
+    return queue;
+}
+
+// Helper function to append a task to its queue (with the executor's lock held)
+static int appendTask(DeviceQueue* queue, CopyTask* task) {
+    // Drop the claimed tasks once they are most of the array
+    if (queue->next > 0 && queue->next * 2 >= queue->numTasks) {
+        memmove(queue->tasks, queue->tasks + queue->next, (size_t)(queue->numTasks - queue->next) * sizeof(CopyTask));
+        queue->numTasks -= queue->next;
+        queue->next = 0;
+    }
+    if (queue->numTasks == queue->maxTasks) {
+        int maxTasks = queue->maxTasks > 0 ? queue->maxTasks * 2 : 64;
+        CopyTask* temp = (CopyTask*)realloc(queue->tasks, maxTasks * sizeof(CopyTask));
+        if (temp == NULL) {
+            return 1;
+        }
+        queue->tasks = temp;
+        queue->maxTasks = maxTasks;
+    }
+    queue->tasks[queue->numTasks++] = *task;
+    return 0;
+}
+
+// One copy of a batch while it is split into tasks
+typedef struct {
+    DeviceQueue* queue;
+    const char* sourcePath;
+    dev_t destinationDevice;
+    int index;
+} PendingCopy;
+
+// Helper function to order copies by queue, then source, keeping plan order within a source
+static int comparePendingCopies(const void* a, const void* b) {
+    const PendingCopy* x = (const PendingCopy*)a;
+    const PendingCopy* y = (const PendingCopy*)b;
+    if (x->queue != y->queue) {return x->queue < y->queue ? -1 : 1;}
+    int result = strcmp(x->sourcePath, y->sourcePath);
+    return result != 0 ? result : (x->index > y->index) - (x->index < y->index);
+}
+
+// Helper function to order tasks by their first copy's place in the batch
+static int compareTasks(const void* a, const void* b) {
+    const CopyTask* x = (const CopyTask*)a;
+    const CopyTask* y = (const CopyTask*)b;
+    return (x->sequence > y->sequence) - (x->sequence < y->sequence);
+}
+
+// Helper function to split a batch's copies into tasks, one per source, in batch order,
+// skipping those already handled (linked). Returns the number of tasks.
+static int buildCopyTasks(SyncExecutor* executor, SyncPlan* plan, const int* handled, CopyTask* tasks) {
+    PendingCopy* copies = (PendingCopy*)malloc((size_t)plan->numOperations * sizeof(PendingCopy));
+    if (copies == NULL) {
+        logErrno("Memory allocation error");
+        return 0;
+    }
+
+    int numCopies = 0;
+    char* lastDirectory = NULL;
+    dev_t lastDevice = 0;
+    for (int i = 0; i < plan->numOperations; i++) {
+        CopyOperation* operation = &plan->operations[i];
+        if (handled[i]) {
+            continue;
+        }
+        DeviceQueue* queue = findDeviceQueue(executor, operation->device);
+        if (queue != NULL) {
+            copies[numCopies].queue = queue;
+            copies[numCopies].sourcePath = operation->sourcePath;
+            copies[numCopies].destinationDevice = planDestinationDevice(operation->destinationPath, &lastDirectory, &lastDevice);
+            copies[numCopies].index = i;
+            numCopies++;
+        }
+    }
+    free(lastDirectory);
+    qsort(copies, numCopies, sizeof(PendingCopy), comparePendingCopies);
+
+    int numTasks = 0;
+    for (int start = 0, end; start < numCopies; start = end) {
+        end = start + 1;
+        while (end < numCopies && copies[end].queue == copies[start].queue
+               && strcmp(copies[end].sourcePath, copies[start].sourcePath) == 0) {
+            end++;
+        }
+
+        CopyTask* task = &tasks[numTasks];
+        task->operations = (CopyOperation**)malloc((size_t)(end - start) * sizeof(CopyOperation*));
+        task->devices = (dev_t*)malloc((size_t)(end - start + 1) * sizeof(dev_t));
+        if (task->operations == NULL || task->devices == NULL) {
+            logErrno("Memory allocation error");
+            free(task->operations);
+            free(task->devices);
+            continue;
+        }
+        task->queue = copies[start].queue;
+        task->numOperations = end - start;
+        task->sequence = copies[start].index;
+        task->devices[0] = task->queue->device;
+        task->numDevices = 1;
+        for (int k = start; k < end; k++) {
+            task->operations[k - start] = &plan->operations[copies[k].index];
+            int known = 0;
+            for (int d = 0; d < task->numDevices && !known; d++) {
+                known = task->devices[d] == copies[k].destinationDevice;
+            }
+            if (!known) {
+                task->devices[task->numDevices++] = copies[k].destinationDevice;
+            }
+        }
+        numTasks++;
+    }
+    free(copies);
+
+    qsort(tasks, numTasks, sizeof(CopyTask), compareTasks);
+    return numTasks;
+}
+
+// Function to start an executor whose device queues keep running until it is finished,
+// so batches submitted one after another are copied as one stream
+SyncExecutor* startSyncExecutor(ProgramOptions opts, SyncResources* resources) {
+    SyncExecutor* executor = (SyncExecutor*)calloc(1, sizeof(SyncExecutor));
+    if (executor == NULL) {
+        logErrno("Memory allocation error");
+        return NULL;
+    }
+
+    executor->opts = opts;
+    executor->resources = resources;
+    pthread_mutex_init(&executor->lock, NULL);
+    pthread_cond_init(&executor->progressed, NULL);
+    return executor;
+}
+
+// Function to queue every copy of a batch (from one thread at a time). All copies of the
+// same source in a batch are made together, reading the source once, and queued by source
+// device. The queues run in parallel, but no device is read or written by more than
+// opts.deviceConcurrency copies at a time, counting every executor of the process. Within
+// a queue copies keep submission order. While PLAN_PENDING_LIMIT copies are pending this
+// waits first. The batch's operations must stay in place until the executor is finished.
+int submitSyncPlan(SyncExecutor* executor, SyncPlan* plan) {
+    int numOperations = plan->numOperations;
+    if (numOperations <= 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&executor->lock);
+    while (executor->pending >= PLAN_PENDING_LIMIT) {
+        pthread_cond_wait(&executor->progressed, &executor->lock);
+    }
+    executor->progress.numOperations += numOperations;
+    for (int i = 0; i < numOperations; i++) {
+        executor->progress.bytesTotal += plan->operations[i].size;
+    }
+    pthread_mutex_unlock(&executor->lock);
+
+    int* handled = (int*)calloc((size_t)numOperations, sizeof(int));
+    CopyTask* tasks = (CopyTask*)malloc((size_t)numOperations * sizeof(CopyTask));
+    int numTasks = 0;
+    if (handled == NULL || tasks == NULL) {
+        logErrno("Memory allocation error");
+        free(handled);
+        handled = NULL;
+    }
+
+    // Moved files are linked (reflinked, or else hardlinked) first, before any copy of the
+    // batch can replace the file linked to (-m plans everything as one batch). If the link can't be made (another
+    // device, no hardlink support) the file is copied.
+    for (int i = 0; handled != NULL && i < numOperations; i++) {
+        CopyOperation* operation = &plan->operations[i];
+        if (operation->linkSource == NULL) {
+            continue;
+        }
+
+        TRACE_BEGIN("link", operation->destinationPath);
+        double start = monotonicSeconds();
+        if (placeMovedFile(operation->linkSource, operation->destinationPath) == 0) {
+            handled[i] = 1;
+            operation->seconds = monotonicSeconds() - start;
+            pthread_mutex_lock(&executor->lock);
+            reportProgress(executor, operation, 0, 1);
+            pthread_mutex_unlock(&executor->lock);
+        } else {
+            logMessage(LOG_LEVEL_VERBOSE, "Could not link %s to %s (%s), copying instead\n",
+                       operation->linkSource, operation->destinationPath, strerror(errno));
+        }
+        TRACE_END("link", operation->destinationPath);
+    }
+    if (handled != NULL) {
+        numTasks = buildCopyTasks(executor, plan, handled, tasks);
+    }
+
+    // Queue the tasks. Anything that couldn't be queued has failed.
+    pthread_mutex_lock(&executor->lock);
+    for (int t = 0; t < numTasks; t++) {
+        CopyTask* task = &tasks[t];
+        if (appendTask(task->queue, task) != 0) {
+            logErrno("Memory allocation error");
+            free(task->operations);
+            free(task->devices);
+            continue;
+        }
+        executor->pending += task->numOperations;
+        for (int k = 0; k < task->numOperations; k++) {
+            handled[task->operations[k] - plan->operations] = 1;
+        }
+        pthread_cond_signal(&task->queue->notEmpty);
+    }
+    for (int i = 0; i < numOperations; i++) {
+        if (handled == NULL || !handled[i]) {
+            reportProgress(executor, &plan->operations[i], 1, 0);
+        }
+    }
+    pthread_mutex_unlock(&executor->lock);
+
+    // Queues without a thread of their own are drained here
+    for (int q = 0; q < executor->numQueues; q++) {
+        if (executor->queues[q]->numWorkers == 0) {
+            runQueue(executor, executor->queues[q], NULL, 0);
+        }
+    }
+
+    free(handled);
+    free(tasks);
+    return 0;
+}
+
+// Function to wait for every submitted copy, stop the queues and free the executor.
+// Returns the number of failed copies.
+int finishSyncExecutor(SyncExecutor* executor) {
+    pthread_mutex_lock(&executor->lock);
+    executor->finishing = 1;
+    for (int q = 0; q < executor->numQueues; q++) {
+        pthread_cond_broadcast(&executor->queues[q]->notEmpty);
+    }
+    pthread_mutex_unlock(&executor->lock);
+
+    for (int w = 0; w < executor->numWorkers; w++) {
+        pthread_join(executor->workers[w]->thread, NULL);
+        free(executor->workers[w]);
+    }
+    if (executor->numWorkers > 1) {
+        logMessage(LOG_LEVEL_VERBOSE, "Copied through %d device queues with %d threads\n",
+                   executor->numQueues, executor->numWorkers);
+    }
+
+    for (int q = 0; q < executor->numQueues; q++) {
+        pthread_cond_destroy(&executor->queues[q]->notEmpty);
+        free(executor->queues[q]->tasks);
+        free(executor->queues[q]);
+    }
+    free(executor->queues);
+    free(executor->workers);
+    freeSyncResources(&executor->local);
+    pthread_cond_destroy(&executor->progressed);
+    pthread_mutex_destroy(&executor->lock);
+
+    int failures = executor->failures;
+    free(executor);
+    return failures;
+}
+
+// Function to perform every copy in the plan (see submitSyncPlan), returns the number of
+// failed copies
+int executeSyncPlan(SyncPlan* plan, ProgramOptions opts, SyncResources* resources) {
+    // Directories left for execution are made first, parents before their children
+    if (plan->deferDirectories) {
+        for (int i = 0; i < plan->numDirectories; i++) {
+            makeDestinationDirectory(plan->directories[i], plan->directorySources[i], opts);
+        }
+        plan->deferDirectories = 0;
+    }
+
+    if (plan->numOperations <= 0) {
+        return 0;
+    }
+
+    SyncExecutor* executor = startSyncExecutor(opts, resources);
+    if (executor == NULL) {
+        return plan->numOperations;
+    }
+    submitSyncPlan(executor, plan);
+    return finishSyncExecutor(executor);
+}
+
+// Function to free the buffers and threads held by execution resources
+void freeSyncResources(SyncResources* resources) {
+    for (int i = 0; i < resources->numWorkspaces; i++) {
+        freeFanOutWorkspace(resources->workspaces[i]);
+    }
+    free(resources->workspaces);
+    resources->workspaces = NULL;
+    resources->numWorkspaces = 0;
+}
+
+// Function to free a plan and the paths it owns
+void freeSyncPlan(SyncPlan* plan) {
+    if (plan == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < plan->numOperations; i++) {
+        free(plan->operations[i].sourcePath);
+        free(plan->operations[i].destinationPath);
+        free(plan->operations[i].linkSource);
+    }
+    free(plan->operations);
+    for (int i = 0; i < plan->numDirectories; i++) {
+        free(plan->directories[i]);
+        free(plan->directorySources[i]);
+    }
+    free(plan->directorySources);
+    free(plan->directories);
+    free(plan);
+}
+
+// Function to convert an -s argument to a copy order (0 on success)
+int parseCopyOrder(const char* name, CopyOrder* order) {
+    for (CopyOrder candidate = ORDER_NONE; candidate <= ORDER_SIZE; candidate++) {
+        if (strcmp(name, copyOrderName(candidate)) == 0) {
+            *order = candidate;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+const char* copyOrderName(CopyOrder order) {
+    switch (order) {
+        case ORDER_NONE: return "none";
+        case ORDER_INODE: return "inode";
+        case ORDER_EXTENT: return "extent";
+        case ORDER_SIZE: return "size";
+    }
+    return "unknown";
+}
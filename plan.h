@@ -0,0 +1,96 @@
+#ifndef PLAN_H
+#define PLAN_H
+#include "options.h"
+#include "fanout.h"
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef struct {
+    char* sourcePath;
+    char* destinationPath;
+    char* linkSource;   // Existing file in the destination's root to hardlink instead (moves, -m)
+    int isUpdate;       // Replacing an outdated file (1) or creating a new one (0)
+    off_t size;
+    dev_t device;       // Source device
+    ino_t inode;        // Source inode
+    uint64_t physical;  // Source's first physical extent (when known)
+    int sequence;       // Position in planning (readdir) order
+    double seconds;     // Time spent writing it, alongside any other copies of its source (set when executed)
+    int result;         // 0 once written successfully (set when executed)
+} CopyOperation;
+
+typedef struct SyncPlan SyncPlan;
+
+// Receives batches of a plan as planning goes (see flushSyncPlan), taking ownership
+typedef int (*SyncPlanSink)(SyncPlan* batch, void* sinkData);
+
+struct SyncPlan {
+    CopyOperation* operations;
+    int numOperations;
+    char** directories; // Destination directories created (or to be created, with -n)
+    char** directorySources; // Source directory of each (for -p)
+    int numDirectories;
+    int deferDirectories; // Only record directories while planning, executeSyncPlan makes them
+    SyncPlanSink sink;  // NULL to keep every operation in the plan
+    void* sinkData;
+};
+
+// Copies submitted to an executor and not finished yet before submitting more waits
+#define PLAN_PENDING_LIMIT 4096
+
+// Progress of an execution (all batches so far), reported after each destination is written
+typedef struct {
+    int operationsDone;
+    int numOperations;
+    long long bytesDone;
+    long long bytesCopied; // Of bytesDone, those actually written (not failed or linked)
+    long long bytesTotal;
+    const char* sourcePath;
+    const char* destinationPath;
+    int result; // 0 if this destination was written successfully
+} SyncProgress;
+
+typedef void (*SyncProgressCallback)(const SyncProgress* progress, void* userData);
+
+// Copies batches of a plan through device queues that run until it is finished
+typedef struct SyncExecutor SyncExecutor;
+
+// State kept between plan executions (optional, see libmysync)
+typedef struct {
+    FanOutWorkspace** workspaces; // Fan-out copy buffers and writers, one per queue worker, created on first use
+    int numWorkspaces;
+    SyncProgressCallback progress;
+    void* progressData;
+} SyncResources;
+
+// Function prototypes
+SyncPlan* createSyncPlan();
+
+int addCopyOperation(SyncPlan* plan, const char* sourcePath, const char* destinationPath, int isUpdate,
+                     off_t size, dev_t device, ino_t inode, const char* linkSource);
+
+int addDirectoryOperation(SyncPlan* plan, const char* path, const char* sourcePath);
+
+int flushSyncPlan(SyncPlan* plan);
+
+void orderSyncPlan(SyncPlan* plan, CopyOrder order);
+
+dev_t planDestinationDevice(const char* destinationPath, char** lastDirectory, dev_t* lastDevice);
+
+SyncExecutor* startSyncExecutor(ProgramOptions opts, SyncResources* resources);
+
+int submitSyncPlan(SyncExecutor* executor, SyncPlan* plan);
+
+int finishSyncExecutor(SyncExecutor* executor);
+
+int executeSyncPlan(SyncPlan* plan, ProgramOptions opts, SyncResources* resources);
+
+void freeSyncResources(SyncResources* resources);
+
+void freeSyncPlan(SyncPlan* plan);
+
+int parseCopyOrder(const char* name, CopyOrder* order);
+
+const char* copyOrderName(CopyOrder order);
+
+#endif
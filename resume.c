@@ -0,0 +1,220 @@
+#include "resume.h"
+#include "log.h"
+#include "hash.h"
+#include "fsio.h"
+#include "utility.h"
+#include "budget.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#define RESUME_BUFFER_SIZE (1024 * 1024)
+
+// Function to check whether a directory entry is one of our partial or checkpoint files
+int isResumeArtifact(const char* name) {
+    const char* suffixes[] = {RESUME_PARTIAL_SUFFIX, RESUME_CHECKPOINT_SUFFIX, RESUME_CHECKPOINT_NEW_SUFFIX};
+    size_t length = strlen(name);
+
+    for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+        size_t suffixLength = strlen(suffixes[i]);
+        if (length > suffixLength && strcmp(name + length - suffixLength, suffixes[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Helper function to build "directory/.filename<suffix>" next to the destination
+static char* resumeSidePath(const char* destinationPath, const char* suffix) {
+    const char* slash = strrchr(destinationPath, '/');
+    size_t directoryLength = slash ? (size_t)(slash - destinationPath + 1) : 0;
+    const char* filename = destinationPath + directoryLength;
+
+    size_t size = strlen(destinationPath) + strlen(suffix) + 2;
+    char* path = (char*)malloc(size);
+    if (path == NULL) {
+        logErrno("Memory allocation error");
+        return NULL;
+    }
+
+    snprintf(path, size, "%.*s.%s%s", (int)directoryLength, destinationPath, filename, suffix);
+    return path;
+}
+
+// Helper function returning the checkpointed offset, or 0 if there is no usable checkpoint
+static off_t resumeReadCheckpoint(const char* checkpointPath, const struct stat* sourceInfo) {
+    int fd = fsioOpen(checkpointPath, O_RDONLY, 0);
+    FILE* file = fd == -1 ? NULL : fdopen(fd, "r");
+    if (file == NULL) {
+        if (fd != -1) {close(fd);}
+        return 0;
+    }
+
+    long long size, mtime, offset;
+    long mtimeNanoseconds;
+    int fields = fscanf(file, "mysync-checkpoint size %lld mtime %lld.%ld offset %lld", &size, &mtime, &mtimeNanoseconds, &offset);
+    fclose(file);
+
+    // The source must be unchanged since the checkpoint was written (checkpoints from
+    // before times were kept to the nanosecond don't match, and the copy restarts)
+    if (fields != 4 || size != (long long)sourceInfo->st_size || mtime != (long long)sourceInfo->st_mtim.tv_sec
+        || mtimeNanoseconds != sourceInfo->st_mtim.tv_nsec) {
+        return 0;
+    }
+    if (offset < 0 || offset > size) {
+        return 0;
+    }
+    return (off_t)offset;
+}
+
+// Helper function to record that the partial file is durable up to offset. The checkpoint
+// is written to newPath and renamed over checkpointPath, so a crash part way through the
+// write leaves the previous checkpoint in place.
+static void resumeWriteCheckpoint(const char* checkpointPath, const char* newPath, const struct stat* sourceInfo,
+                                  off_t offset) {
+    int fd = fsioOpen(newPath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    FILE* file = fd == -1 ? NULL : fdopen(fd, "w");
+    if (file == NULL) {
+        logErrno("Error writing checkpoint");
+        if (fd != -1) {close(fd);}
+        return;
+    }
+
+    fprintf(file, "mysync-checkpoint size %lld mtime %lld.%09ld offset %lld\n",
+            (long long)sourceInfo->st_size, (long long)sourceInfo->st_mtim.tv_sec, sourceInfo->st_mtim.tv_nsec,
+            (long long)offset);
+    if (fflush(file) != 0 || fdatasync(fd) == -1) {
+        logErrno("Error writing checkpoint");
+        fclose(file);
+        fsioUnlink(newPath);
+        return;
+    }
+    fclose(file);
+
+    if (fsioRename(newPath, checkpointPath) == -1) {
+        logErrno("Error renaming checkpoint");
+        fsioUnlink(newPath);
+    }
+}
+
+// Helper function to compare the bytes just before offset in the source and the partial file
+static int resumeTailMatches(int sourceFile, int partialFile, off_t offset) {
+    off_t window = offset < RESUME_VERIFY_WINDOW ? offset : RESUME_VERIFY_WINDOW;
+    uint64_t sourceHash, partialHash;
+
+    if (hashFileRange(sourceFile, offset - window, window, &sourceHash) != 0) {
+        return 0;
+    }
+    if (hashFileRange(partialFile, offset - window, window, &partialHash) != 0) {
+        return 0;
+    }
+    return sourceHash == partialHash;
+}
+
+// Function to copy an open source file to destinationPath via a checkpointed partial file,
+// continuing from an earlier interrupted copy when the source is unchanged
+int copyFileResumable(int sourceFile, const struct stat* sourceInfo, const char* destinationPath, int verifyTail,
+                      int preserveMetadata) {
+    char* partialPath = resumeSidePath(destinationPath, RESUME_PARTIAL_SUFFIX);
+    char* checkpointPath = resumeSidePath(destinationPath, RESUME_CHECKPOINT_SUFFIX);
+    char* newCheckpointPath = resumeSidePath(destinationPath, RESUME_CHECKPOINT_NEW_SUFFIX);
+    char* buffer = (char*)malloc(RESUME_BUFFER_SIZE);
+    int partialFile = -1;
+    int result = 1;
+
+    if (partialPath == NULL || checkpointPath == NULL || newCheckpointPath == NULL || buffer == NULL) {
+        goto cleanup;
+    }
+
+    partialFile = fsioOpen(partialPath, O_RDWR | O_CREAT, 0666);
+    if (partialFile == -1) {
+        logErrno("Error opening partial file");
+        goto cleanup;
+    }
+
+    // Work out where to continue from
+    off_t offset = resumeReadCheckpoint(checkpointPath, sourceInfo);
+    struct stat partialInfo;
+    if (offset > 0 && (fstat(partialFile, &partialInfo) == -1 || partialInfo.st_size < offset)) {
+        offset = 0;
+    }
+    if (offset > 0 && verifyTail && !resumeTailMatches(sourceFile, partialFile, offset)) {
+        logMessage(LOG_LEVEL_WARN, "Partial file %s failed verification, restarting copy\n", partialPath);
+        offset = 0;
+    }
+    if (offset > 0) {
+        logMessage(LOG_LEVEL_INFO, "Resuming %s at byte %lld of %lld\n", destinationPath, (long long)offset, (long long)sourceInfo->st_size);
+    }
+
+    // Discard anything written after the last checkpoint
+    if (ftruncate(partialFile, offset) == -1) {
+        logErrno("Error truncating partial file");
+        goto cleanup;
+    }
+
+    off_t lastCheckpoint = offset;
+    ssize_t bytesRead;
+    while ((bytesRead = pread(sourceFile, buffer, RESUME_BUFFER_SIZE, offset)) > 0) {
+        BUDGET_CONSUME(bytesRead);
+        for (ssize_t written = 0; written < bytesRead; ) {
+            ssize_t bytesWritten = pwrite(partialFile, buffer + written, bytesRead - written, offset + written);
+            if (bytesWritten == -1) {
+                logErrno("Error writing to partial file");
+                goto cleanup;
+            }
+            written += bytesWritten;
+        }
+        offset += bytesRead;
+
+        // Only checkpoint data that has reached the disk
+        if (offset - lastCheckpoint >= RESUME_CHECKPOINT_INTERVAL) {
+            if (fdatasync(partialFile) == 0) {
+                resumeWriteCheckpoint(checkpointPath, newCheckpointPath, sourceInfo, offset);
+                lastCheckpoint = offset;
+            }
+        }
+    }
+    if (bytesRead == -1) {
+        logErrno("Error reading source file");
+        goto cleanup;
+    }
+
+    // Apply the source's metadata (-p), otherwise an existing destination keeps its
+    // permissions as it would with an in-place copy (and the copy gets the source's
+    // modification time either way)
+    struct stat destinationInfo;
+    if (preserveMetadata) {
+        applyMetadata(partialFile, sourceInfo, destinationPath);
+    } else {
+        if (fsioStat(destinationPath, &destinationInfo) == 0) {
+            fchmod(partialFile, destinationInfo.st_mode & 07777);
+        }
+        applyModificationTime(partialFile, sourceInfo);
+    }
+
+    if (fdatasync(partialFile) == -1) {
+        logErrno("Error flushing partial file");
+        goto cleanup;
+    }
+    close(partialFile);
+    partialFile = -1;
+
+    if (fsioRename(partialPath, destinationPath) == -1) {
+        logErrno("Error renaming partial file");
+        goto cleanup;
+    }
+    fsioUnlink(checkpointPath);
+    result = 0;
+
+cleanup:
+    if (partialFile != -1) {
+        close(partialFile);
+    }
+    free(partialPath);
+    free(checkpointPath);
+    free(newCheckpointPath);
+    free(buffer);
+    return result;
+}
@@ -0,0 +1,26 @@
+#ifndef RESUME_H
+#define RESUME_H
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// Partial data and its checkpoint live next to the destination as hidden files
+#define RESUME_PARTIAL_SUFFIX ".mysync-part"
+#define RESUME_CHECKPOINT_SUFFIX ".mysync-ckpt"
+#define RESUME_CHECKPOINT_NEW_SUFFIX ".mysync-ckpt-new" // Written, then renamed over the checkpoint
+
+// Files smaller than this are cheaper to recopy than to checkpoint
+#define RESUME_MIN_SIZE (8 * 1024 * 1024)
+
+// Bytes copied between checkpoints
+#define RESUME_CHECKPOINT_INTERVAL (64 * 1024 * 1024)
+
+// Bytes before the checkpoint offset that are rehashed when verifying a resume
+#define RESUME_VERIFY_WINDOW (1024 * 1024)
+
+// Function prototypes
+int isResumeArtifact(const char* name);
+
+int copyFileResumable(int sourceFile, const struct stat* sourceInfo, const char* destinationPath, int verifyTail,
+                      int preserveMetadata);
+
+#endif
@@ -0,0 +1,65 @@
+#!/bin/sh
+# Regression checks for job files (-f). Usage: tests/jobs.sh [mysync binary]
+# (run by make test)
+MYSYNC=${1:-./mysync}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+failures=0
+
+fail() {
+    echo "FAIL: $1"
+    failures=$((failures + 1))
+}
+
+mkdir -p "$WORK/a" "$WORK/b" "$WORK/c" "$WORK/d" "$WORK/e"
+echo visible > "$WORK/a/file"
+echo hidden > "$WORK/a/.hidden"
+
+# Each line is parsed on its own: options from one line (-p, -a on earlier lines) must not
+# leak into the next, and unknown options fail only their own line
+cat > "$WORK/jobs" <<JOBS
+-r -p -a $WORK/a $WORK/d
+-r $WORK/a $WORK/b
+-Z $WORK/a $WORK/c
+-r $WORK/a $WORK/e -x bogus
+JOBS
+
+"$MYSYNC" -f "$WORK/jobs" > "$WORK/output" 2>&1
+status=$?
+[ "$status" -eq 1 ] || fail "expected exit status 1 for a job file with bad lines, got $status"
+
+[ -f "$WORK/d/.hidden" ] || fail "first set (-a) didn't copy .hidden"
+[ -f "$WORK/b/file" ] || fail "second set didn't copy file"
+[ ! -e "$WORK/b/.hidden" ] || fail "second set copied .hidden without -a"
+[ ! -e "$WORK/c/file" ] || fail "set with an unknown option (-Z) ran"
+[ ! -e "$WORK/e/file" ] || fail "set with an unknown option (-x) ran"
+grep -q "invalid option -- '/'" "$WORK/output" && fail "an option was read from a previous line"
+
+# A job file with only good lines succeeds
+rm -rf "$WORK/b" && mkdir "$WORK/b"
+echo "$WORK/a $WORK/b" > "$WORK/jobs"
+"$MYSYNC" -f "$WORK/jobs" > "$WORK/output" 2>&1 || fail "good job file failed"
+[ -f "$WORK/b/file" ] || fail "good job file didn't copy file"
+
+# The report is printed whatever the log level
+"$MYSYNC" -l error -f "$WORK/jobs" > "$WORK/output" 2>&1
+grep -q "^Jobs: 1 run, 0 failed" "$WORK/output" || fail "job report missing with -l error"
+
+# A deferred set (-w, with recorded rates that make it too slow) leaves its destination
+# untouched: directories are only made when a set is copied
+mkdir -p "$WORK/a/sub" "$WORK/f"
+echo nested > "$WORK/a/sub/nested"
+echo "$(stat -c %d "$WORK/f") 0.001 1" > "$WORK/rates"
+echo "-w 1 -r $WORK/a $WORK/f" > "$WORK/jobs"
+MYSYNC_RATES="$WORK/rates" "$MYSYNC" -f "$WORK/jobs" > "$WORK/output" 2>&1
+status=$?
+[ "$status" -eq 3 ] || fail "expected exit status 3 for a deferred set, got $status"
+[ -z "$(ls -A "$WORK/f")" ] || fail "deferred set wrote to its destination"
+MYSYNC_RATES="$WORK/rates" "$MYSYNC" -w 1 -r "$WORK/a" "$WORK/f" > /dev/null 2>&1
+[ -z "$(ls -A "$WORK/f")" ] || fail "deferred sync wrote to its destination"
+
+if [ "$failures" -ne 0 ]; then
+    echo "$failures job file check(s) failed"
+    exit 1
+fi
+echo "Job file checks passed"
@@ -0,0 +1,72 @@
+#!/bin/sh
+# Regression checks for timestamp comparison. Usage: tests/timestamps.sh [mysync binary]
+# (run by make test)
+MYSYNC=${1:-./mysync}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+failures=0
+
+fail() {
+    echo "FAIL: $1"
+    failures=$((failures + 1))
+}
+
+# Count the files a sync copies or updates (from its -v output)
+countCopies() {
+    "$MYSYNC" -v "$@" 2>&1 | grep -cE '^(Syncing|Copying) .+ to '
+}
+
+# Copies made without -p mustn't look newer than their source on the next run, or the
+# files are copied back and forth on every run. Covers a single copy, a fan-out copy
+# (one large source to several roots) and a resumable copy (-c).
+mkdir -p "$WORK/a/sub" "$WORK/b" "$WORK/c"
+echo one > "$WORK/a/small"
+echo two > "$WORK/a/sub/nested"
+head -c 9000000 /dev/urandom > "$WORK/a/large"
+
+"$MYSYNC" -r "$WORK/a" "$WORK/b" > /dev/null 2>&1 || fail "first sync of a and b"
+for run in 1 2 3; do
+    copies=$(countCopies -r "$WORK/a" "$WORK/b")
+    [ "$copies" -eq 0 ] || fail "repeat sync $run of a and b copied $copies files"
+done
+
+"$MYSYNC" -r "$WORK/a" "$WORK/b" "$WORK/c" > /dev/null 2>&1 || fail "first sync of a, b and c"
+copies=$(countCopies -r "$WORK/a" "$WORK/b" "$WORK/c")
+[ "$copies" -eq 0 ] || fail "repeat sync of a, b and c copied $copies files"
+
+rm -rf "$WORK/c" && mkdir "$WORK/c"
+"$MYSYNC" -r -c "$WORK/a" "$WORK/c" > /dev/null 2>&1 || fail "first resumable sync"
+copies=$(countCopies -r -c "$WORK/a" "$WORK/c")
+[ "$copies" -eq 0 ] || fail "repeat resumable sync copied $copies files"
+
+# A changed file is still copied
+sleep 1
+echo changed > "$WORK/b/small"
+copies=$(countCopies -r "$WORK/a" "$WORK/b")
+[ "$copies" -eq 1 ] || fail "changed file: expected 1 copy, got $copies"
+cmp -s "$WORK/a/small" "$WORK/b/small" || fail "changed file wasn't copied back"
+
+# A dry run doesn't write to the destination (no timestamp probe file)
+mkdir "$WORK/d"
+before=$(stat -c %Y.%y "$WORK/d")
+"$MYSYNC" -n -r "$WORK/a" "$WORK/d" > /dev/null 2>&1
+after=$(stat -c %Y.%y "$WORK/d")
+[ "$before" = "$after" ] || fail "dry run modified the destination directory"
+[ -z "$(ls -A "$WORK/d")" ] || fail "dry run left files in the destination"
+
+# A dry run plans the same copies as a real run, even when the destination directory's
+# own time is a whole second (the granularity isn't guessed from it)
+mkdir "$WORK/g" "$WORK/h"
+echo same > "$WORK/g/file"
+cp "$WORK/g/file" "$WORK/h/file"
+touch -d @1500000000.5 "$WORK/g/file"
+touch -d @1500000000 "$WORK/h/file" "$WORK/h"
+dry=$(countCopies -n "$WORK/g" "$WORK/h")
+real=$(countCopies "$WORK/g" "$WORK/h")
+[ "$dry" -eq "$real" ] || fail "dry run planned $dry copies, the real run made $real"
+
+if [ "$failures" -ne 0 ]; then
+    echo "$failures timestamp check(s) failed"
+    exit 1
+fi
+echo "Timestamp checks passed"
@@ -0,0 +1,199 @@
+#include "timestamp.h"
+#include "fsio.h"
+#include "log.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/vfs.h>
+#endif
+
+// Time written to the probe file: an even second with every sub-second digit set
+#define PROBE_SECONDS 1000000000
+#define PROBE_NANOSECONDS 123456789
+
+// Filesystem types (statfs f_type) with coarse timestamps
+#define MSDOS_FILESYSTEM 0x4d44 // FAT and vfat
+#define EXFAT_FILESYSTEM 0x2011bab0
+#define CIFS_FILESYSTEM 0xff534d42
+#define SMB2_FILESYSTEM 0xfe534d42
+#define SMB_FILESYSTEM 0x517b
+
+typedef struct {
+    dev_t device;
+    long long granularity;
+} GranularityEntry;
+
+// Granularity of each filesystem probed so far, by device
+static GranularityEntry* granularities = NULL;
+static int numGranularities = 0;
+static int numProbes = 0; // Numbers the probe files, so concurrent probes don't collide
+static pthread_mutex_t granularityLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Function returning a - b in nanoseconds
+long long timestampDifference(struct timespec a, struct timespec b) {
+    return (long long)(a.tv_sec - b.tv_sec) * NANOSECONDS_PER_SECOND + (a.tv_nsec - b.tv_nsec);
+}
+
+// Function to compare two timestamps for qsort (-1, 0 or 1)
+int compareTimestamps(struct timespec a, struct timespec b) {
+    if (a.tv_sec != b.tv_sec) {
+        return a.tv_sec < b.tv_sec ? -1 : 1;
+    }
+    return (a.tv_nsec > b.tv_nsec) - (a.tv_nsec < b.tv_nsec);
+}
+
+// Function to check whether a is newer than b by more than window nanoseconds
+int timestampNewer(struct timespec a, struct timespec b, long long window) {
+    return timestampDifference(a, b) > window;
+}
+
+// Helper function to set a file's times and read back the modification time it kept
+static int probeTimes(int fd, time_t seconds, long nanoseconds, struct timespec* stored) {
+    struct timespec times[2] = {{seconds, nanoseconds}, {seconds, nanoseconds}};
+    struct stat info;
+    if (futimens(fd, times) == -1 || fstat(fd, &info) == -1) {
+        return 1;
+    }
+    *stored = info.st_mtim;
+    return 0;
+}
+
+// Helper function returning the unit a stored fraction of a second is a whole number of:
+// the largest power of ten dividing it (a second if there is no fraction)
+static long long fractionUnit(long nanoseconds) {
+    if (nanoseconds == 0) {
+        return NANOSECONDS_PER_SECOND;
+    }
+    long long unit = 1;
+    while (unit < NANOSECONDS_PER_SECOND && nanoseconds % (unit * 10) == 0) {
+        unit *= 10;
+    }
+    return unit;
+}
+
+// Helper function to measure a directory's timestamp granularity by setting a known time
+// on a temporary file and seeing what is kept. Returns 0 if it can't be measured (the
+// directory is read-only, for instance).
+static long long probeGranularity(const char* directory, int sequence) {
+    char name[64];
+    snprintf(name, sizeof(name), ".mysync-probe.%ld.%d", (long)getpid(), sequence);
+    char* path = fsioJoinPath(directory, name);
+    if (path == NULL) {
+        return 0;
+    }
+
+    int fd = fsioOpen(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd == -1) {
+        free(path);
+        return 0;
+    }
+
+    long long granularity = 0;
+    struct timespec stored;
+    if (probeTimes(fd, PROBE_SECONDS, PROBE_NANOSECONDS, &stored) == 0) {
+        // Truncated or rounded, the fraction kept is a whole number of units (100 ns on
+        // NTFS, whole seconds on ext3...)
+        granularity = fractionUnit(stored.tv_nsec);
+
+        // FAT keeps only even seconds
+        if (granularity == NANOSECONDS_PER_SECOND && probeTimes(fd, PROBE_SECONDS + 1, 0, &stored) == 0
+            && stored.tv_sec != PROBE_SECONDS + 1) {
+            granularity = 2 * NANOSECONDS_PER_SECOND;
+        }
+    }
+
+    close(fd);
+    fsioUnlink(path);
+    free(path);
+    return granularity;
+}
+
+// Helper function returning the granularity known for the type of filesystem holding a
+// directory: 2 s on FAT and exFAT, 100 ns on SMB shares, otherwise 1 ns
+static long long filesystemGranularity(const char* directory) {
+#ifdef __linux__
+    FsioEntry* entry;
+    int fd = fsioDirFd(directory, &entry);
+    if (fd == -1) {
+        return 1;
+    }
+    struct statfs filesystem;
+    int result = fstatfs(fd, &filesystem);
+    fsioReleaseDirFd(fd, entry);
+    if (result == 0) {
+        switch ((uint32_t)filesystem.f_type) {
+            case MSDOS_FILESYSTEM:
+            case EXFAT_FILESYSTEM:
+                return 2 * NANOSECONDS_PER_SECOND;
+            case CIFS_FILESYSTEM:
+            case SMB2_FILESYSTEM:
+            case SMB_FILESYSTEM:
+                return 100;
+        }
+    }
+#else
+    (void)directory;
+#endif
+    return 1;
+}
+
+// Function to get the timestamp granularity (in nanoseconds) of the filesystem holding a
+// directory, probing it the first time each device is seen. Without mayProbe (dry runs),
+// or where it can't be probed, it is taken from the type of filesystem instead.
+long long timestampGranularity(const char* directory, int mayProbe) {
+    struct stat info;
+    if (fsioStat(directory, &info) == -1) {
+        return 1;
+    }
+
+    pthread_mutex_lock(&granularityLock);
+    for (int i = 0; i < numGranularities; i++) {
+        if (granularities[i].device == info.st_dev) {
+            long long granularity = granularities[i].granularity;
+            pthread_mutex_unlock(&granularityLock);
+            return granularity;
+        }
+    }
+    int sequence = numProbes++;
+    pthread_mutex_unlock(&granularityLock);
+
+    // Probed without the lock, as it writes to the filesystem
+    long long granularity = mayProbe ? probeGranularity(directory, sequence) : 0;
+    if (granularity == 0) {
+        granularity = filesystemGranularity(directory);
+        if (mayProbe) {
+            logMessage(LOG_LEVEL_VERBOSE, "Could not probe timestamps on %s, assuming %lld ns for its filesystem\n",
+                       directory, granularity);
+        }
+        return granularity;
+    }
+    if (granularity > 1) {
+        logMessage(LOG_LEVEL_VERBOSE, "Timestamps on %s are kept to %lld ns\n", directory, granularity);
+    }
+
+    pthread_mutex_lock(&granularityLock);
+    GranularityEntry* temp = (GranularityEntry*)realloc(granularities, (numGranularities + 1) * sizeof(GranularityEntry));
+    if (temp != NULL) {
+        granularities = temp;
+        granularities[numGranularities].device = info.st_dev;
+        granularities[numGranularities].granularity = granularity;
+        numGranularities++;
+    }
+    pthread_mutex_unlock(&granularityLock);
+    return granularity;
+}
+
+// Function to get how far apart (in nanoseconds) two times may be and still count as
+// equal for files in a directory: the larger of -g and the filesystem's granularity
+long long modifyWindow(const char* directory, ProgramOptions opts) {
+    // A dry run (-n) mustn't write the probe file
+    long long granularity = timestampGranularity(directory, !opts.optionN);
+    // Times less than one unit apart may be stored as the same value
+    long long window = granularity - 1;
+    return opts.modifyWindow > window ? opts.modifyWindow : window;
+}
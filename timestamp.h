@@ -0,0 +1,19 @@
+#ifndef TIMESTAMP_H
+#define TIMESTAMP_H
+#include "options.h"
+#include <time.h>
+
+#define NANOSECONDS_PER_SECOND 1000000000LL
+
+// Function prototypes
+long long timestampDifference(struct timespec a, struct timespec b);
+
+int compareTimestamps(struct timespec a, struct timespec b);
+
+int timestampNewer(struct timespec a, struct timespec b, long long window);
+
+long long timestampGranularity(const char* directory, int mayProbe);
+
+long long modifyWindow(const char* directory, ProgramOptions opts);
+
+#endif
@@ -0,0 +1,169 @@
+#include "trace.h"
+#include "utility.h"
+#include "log.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Number of events kept per thread, older events are overwritten once full
+#define TRACE_BUFFER_EVENTS 16384
+#define TRACE_NAME_MAX 128
+#define TRACE_CATEGORY_MAX 16
+
+typedef struct {
+    char phase; // 'B' (begin) or 'E' (end)
+    uint64_t timestamp; // Microseconds since traceInit()
+    char category[TRACE_CATEGORY_MAX];
+    char name[TRACE_NAME_MAX];
+} TraceEvent;
+
+typedef struct TraceBuffer {
+    int threadId;
+    TraceEvent* events;
+    uint64_t numRecorded; // Total events ever recorded (ring index = numRecorded % size)
+    pthread_mutex_t lock; // Held by the owning thread while recording, and by traceWrite
+    struct TraceBuffer* next;
+} TraceBuffer;
+
+int traceEnabled = 0;
+
+static char* traceOutputPath = NULL;
+static uint64_t traceStartTime = 0;
+static TraceBuffer* traceBuffers = NULL;
+static int traceNextThreadId = 1;
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local TraceBuffer* localBuffer = NULL;
+
+// Helper function returning a monotonic time in microseconds
+static uint64_t traceNow() {
+    return (uint64_t)(monotonicSeconds() * 1e6);
+}
+
+// Function to enable tracing, events are written to outputPath when the program exits
+int traceInit(const char* outputPath) {
+    traceOutputPath = strdup(outputPath);
+    if (traceOutputPath == NULL) {
+        logErrno("Memory allocation error");
+        return 1;
+    }
+
+    traceStartTime = traceNow();
+    traceEnabled = 1;
+    atexit(traceWrite);
+    return 0;
+}
+
+// Helper function to get (or lazily register) the calling thread's ring buffer
+static TraceBuffer* traceGetBuffer() {
+    if (localBuffer != NULL) {
+        return localBuffer;
+    }
+
+    TraceBuffer* buffer = (TraceBuffer*)calloc(1, sizeof(TraceBuffer));
+    if (buffer == NULL) {
+        return NULL;
+    }
+    buffer->events = (TraceEvent*)malloc(TRACE_BUFFER_EVENTS * sizeof(TraceEvent));
+    if (buffer->events == NULL) {
+        free(buffer);
+        return NULL;
+    }
+    pthread_mutex_init(&buffer->lock, NULL);
+
+    pthread_mutex_lock(&traceLock);
+    buffer->threadId = traceNextThreadId++;
+    buffer->next = traceBuffers;
+    traceBuffers = buffer;
+    pthread_mutex_unlock(&traceLock);
+
+    localBuffer = buffer;
+    return buffer;
+}
+
+// Helper function to append an event to the calling thread's ring buffer. The buffer's
+// lock is only contended while traceWrite is reading it.
+static void traceRecord(char phase, const char* category, const char* name) {
+    TraceBuffer* buffer = traceGetBuffer();
+    if (buffer == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&buffer->lock);
+    TraceEvent* event = &buffer->events[buffer->numRecorded % TRACE_BUFFER_EVENTS];
+    event->phase = phase;
+    event->timestamp = traceNow() - traceStartTime;
+    snprintf(event->category, TRACE_CATEGORY_MAX, "%s", category);
+    snprintf(event->name, TRACE_NAME_MAX, "%s", name);
+    buffer->numRecorded++;
+    pthread_mutex_unlock(&buffer->lock);
+}
+
+void traceBeginEvent(const char* category, const char* name) {
+    traceRecord('B', category, name);
+}
+
+void traceEndEvent(const char* category, const char* name) {
+    traceRecord('E', category, name);
+}
+
+// Helper function to write a JSON string with the required characters escaped
+static void traceWriteString(FILE* file, const char* string) {
+    fputc('"', file);
+    for (const unsigned char* c = (const unsigned char*)string; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(file, "\\%c", *c);
+        } else if (*c < 0x20) {
+            fprintf(file, "\\u%04x", *c);
+        } else {
+            fputc(*c, file);
+        }
+    }
+    fputc('"', file);
+}
+
+// Function to write all recorded events as Chrome trace-event JSON (registered with atexit)
+void traceWrite() {
+    if (!traceEnabled) {
+        return;
+    }
+    traceEnabled = 0;
+
+    FILE* file = fopen(traceOutputPath, "w");
+    if (file == NULL) {
+        logErrno("Error opening trace file");
+        return;
+    }
+
+    pthread_mutex_lock(&traceLock);
+    fprintf(file, "{\"traceEvents\":[\n");
+    int first = 1;
+    uint64_t numOverwritten = 0;
+    for (TraceBuffer* buffer = traceBuffers; buffer != NULL; buffer = buffer->next) {
+        // Threads still running may be recording, so read each buffer under its lock
+        pthread_mutex_lock(&buffer->lock);
+        uint64_t start = 0;
+        if (buffer->numRecorded > TRACE_BUFFER_EVENTS) {
+            start = buffer->numRecorded - TRACE_BUFFER_EVENTS;
+            numOverwritten += start;
+        }
+
+        for (uint64_t i = start; i < buffer->numRecorded; i++) {
+            TraceEvent* event = &buffer->events[i % TRACE_BUFFER_EVENTS];
+            fprintf(file, "%s{\"ph\":\"%c\",\"pid\":1,\"tid\":%d,\"ts\":%llu,\"cat\":",
+                    first ? "" : ",\n", event->phase, buffer->threadId,
+                    (unsigned long long)event->timestamp);
+            traceWriteString(file, event->category);
+            fprintf(file, ",\"name\":");
+            traceWriteString(file, event->name);
+            fprintf(file, "}");
+            first = 0;
+        }
+        pthread_mutex_unlock(&buffer->lock);
+    }
+    fprintf(file, "\n],\"otherData\":{\"overwrittenEvents\":%llu}}\n", (unsigned long long)numOverwritten);
+    pthread_mutex_unlock(&traceLock);
+
+    fclose(file);
+}
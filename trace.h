@@ -0,0 +1,20 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Non-zero once traceInit() has succeeded. Checked inline by the TRACE_* macros
+// so that a disabled trace costs a single branch per event.
+extern int traceEnabled;
+
+// Function prototypes
+int traceInit(const char* outputPath);
+
+void traceBeginEvent(const char* category, const char* name);
+
+void traceEndEvent(const char* category, const char* name);
+
+void traceWrite();
+
+#define TRACE_BEGIN(category, name) do { if (traceEnabled) {traceBeginEvent((category), (name));} } while (0)
+#define TRACE_END(category, name) do { if (traceEnabled) {traceEndEvent((category), (name));} } while (0)
+
+#endif
@@ -1,5 +1,13 @@
 #include "mysync.h"
+#include "log.h"
 #include "utility.h"
+#include "trace.h"
+#include "budget.h"
+#include "resume.h"
+#include "plan.h"
+#include "fsio.h"
+#include "move.h"
+#include "timestamp.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -9,7 +17,6 @@
 #include <unistd.h>
 #include <limits.h>
 #include <time.h>
-#include <utime.h>
 #include <fcntl.h>
 #include <regex.h>
 #include <stdbool.h>
@@ -17,33 +24,60 @@
 // Function to print standard useage
 void usage() {
     printf("Usage: ./mysync [options] directory1 directory2 [directory3 ...]\n");
+    printf("       ./mysync [options] -f jobfile\n");
     printf("Options:\n");
     printf("  -a: Include hidden files\n");
-    printf("  -n: Do not copy files (enables -v)\n");
+    printf("  -n: Do not copy files, print an estimate instead (enables -v)\n");
     printf("  -p: Preserve metadata\n");
     printf("  -v: Verbose output\n");
     printf("  -r: Recursive (sync subdirectories)\n");
     printf("  -i [pattern]: Ignore matching\n");
     printf("  -o [pattern]: Only sync matching\n");
+    printf("  -T [file]: Write a Chrome trace-event timeline to file\n");
+    printf("  -c: Resumable copies of large files (checkpointed partial files)\n");
+    printf("  -H: Verify resumed copies and moved files with content hashes\n");
+    printf("  -s [order]: Copy order: none (default), inode, extent or size\n");
+    printf("  -l [level]: Log level: error, warn, info (default) or verbose (-v)\n");
+    printf("  -j: Write log messages as JSON lines\n");
+    printf("  -m: Detect moved / renamed files and reflink (else hardlink, see README) them instead of copying\n");
+    printf("  -f [file]: Run every sync set listed in file (one per line) in this process\n");
+    printf("  -b [MiB/s]: Limit the combined copy rate\n");
+    printf("  -u [count]: Number of job file sync sets run at once (default 4)\n");
+    printf("  -w [seconds]: Defer the sync (exit status 3) if it is predicted to take longer\n");
+    printf("  -d [count]: Copies at a time per device (default 1)\n");
+    printf("  -g [seconds]: Treat modification times this close together as equal\n");
 }
 
 // Function to print debug information after parsing commandline arguements
 void debugPrintOptions(ProgramOptions opts) {
-    printf("=== DEBUG ENABLED ===\n");
-    printf("=== Program Options ===\n");
-    printf("  -a (Hidden Files): %s\n", opts.optionA ? "Enabled" : "Disabled");
-    printf("  -n (NOT Copying (+v)): %s\n", opts.optionN ? "Enabled" : "Disabled");
-    printf("  -p (Preserve Metadata): %s\n", opts.optionP ? "Enabled" : "Disabled");
-    printf("  -v (Verbose Output): %s\n", opts.optionV ? "Enabled" : "Disabled");
-    printf("  -r (Recursive): %s\n", opts.optionR ? "Enabled" : "Disabled");
-    printf("  -i (Ignore Files): %s\n", opts.optionI ? "Enabled" : "Disabled");
-    printf("  -o (Choose Files): %s\n", opts.optionO ? "Enabled" : "Disabled");
-
-    printf("\n=== Directories To Sync ===\n");
+    logMessage(LOG_LEVEL_VERBOSE, "=== DEBUG ENABLED ===\n");
+    logMessage(LOG_LEVEL_VERBOSE, "=== Program Options ===\n");
+    logMessage(LOG_LEVEL_VERBOSE, "  -a (Hidden Files): %s\n", opts.optionA ? "Enabled" : "Disabled");
+    logMessage(LOG_LEVEL_VERBOSE, "  -n (NOT Copying (+v)): %s\n", opts.optionN ? "Enabled" : "Disabled");
+    logMessage(LOG_LEVEL_VERBOSE, "  -p (Preserve Metadata): %s\n", opts.optionP ? "Enabled" : "Disabled");
+    logMessage(LOG_LEVEL_VERBOSE, "  -v (Verbose Output): %s\n", opts.optionV ? "Enabled" : "Disabled");
+    logMessage(LOG_LEVEL_VERBOSE, "  -r (Recursive): %s\n", opts.optionR ? "Enabled" : "Disabled");
+    logMessage(LOG_LEVEL_VERBOSE, "  -i (Ignore Files): %s\n", opts.optionI ? "Enabled" : "Disabled");
+    logMessage(LOG_LEVEL_VERBOSE, "  -o (Choose Files): %s\n", opts.optionO ? "Enabled" : "Disabled");
+    logMessage(LOG_LEVEL_VERBOSE, "  -T (Trace Timeline): %s\n", opts.optionT ? opts.traceFile : "Disabled");
+    logMessage(LOG_LEVEL_VERBOSE, "  -c (Resumable Copies): %s\n", opts.optionC ? "Enabled" : "Disabled");
+    logMessage(LOG_LEVEL_VERBOSE, "  -H (Hash Verification): %s\n", opts.optionH ? "Enabled" : "Disabled");
+    logMessage(LOG_LEVEL_VERBOSE, "  -s (Copy Order): %s\n", copyOrderName(opts.copyOrder));
+    logMessage(LOG_LEVEL_VERBOSE, "  -l (Log Level): %s\n", logLevelName(opts.logLevel));
+    logMessage(LOG_LEVEL_VERBOSE, "  -j (JSON Logs): %s\n", opts.optionJ ? "Enabled" : "Disabled");
+    logMessage(LOG_LEVEL_VERBOSE, "  -m (Move Detection): %s\n", opts.optionM ? "Enabled" : "Disabled");
+    logMessage(LOG_LEVEL_VERBOSE, "  -f (Job File): %s\n", opts.optionF ? opts.jobFile : "Disabled");
+    logMessage(LOG_LEVEL_VERBOSE, "  -b (I/O Budget MiB/s): %d\n", opts.ioBudget);
+    logMessage(LOG_LEVEL_VERBOSE, "  -u (Workers): %d\n", opts.numWorkers);
+    logMessage(LOG_LEVEL_VERBOSE, "  -w (Time Window): %d\n", opts.window);
+    logMessage(LOG_LEVEL_VERBOSE, "  -d (Device Concurrency): %d\n", opts.deviceConcurrency);
+    logMessage(LOG_LEVEL_VERBOSE, "  -g (Modify Window ns): %lld\n", opts.modifyWindow);
+
+    logMessage(LOG_LEVEL_VERBOSE, "\n=== Directories To Sync ===\n");
     for (int i = 0; i < opts.numDirectories; i++) {
-        printf("  %d: %s\n", i + 1, opts.directories[i]);
+        logMessage(LOG_LEVEL_VERBOSE, "  %d: %s\n", i + 1, opts.directories[i]);
     }
-    printf("=== Options Set ===\n\n");
+    logMessage(LOG_LEVEL_VERBOSE, "=== Options Set ===\n\n");
 }
 
 // Function to validate a path and determine its type (1:directory 2:regular file)
@@ -51,7 +85,7 @@ int validatePath(const char* path) {
     struct stat statbuf;
 
     // Use stat to retrieve information about the path
-    if (stat(path, &statbuf) == -1) {
+    if (fsioStat(path, &statbuf) == -1) {
         return 0; // Non-existent
     }
 
@@ -67,32 +101,34 @@ int validatePath(const char* path) {
 }
 
 bool directoryContainsMatchingFiles(const char* directory, ProgramOptions opts) {
-    DIR* dir = opendir(directory);
+    DIR* dir = fsioOpenDir(directory);
     if (dir == NULL) {
-        fprintf(stderr, "Error opening directory: %s\n", directory);
+        logMessage(LOG_LEVEL_ERROR, "Error opening directory: %s\n", directory);
         return false;
     }
 
     struct dirent* entry;
     while ((entry = readdir(dir)) != NULL) {
+        // Never descend into [.] and [..]
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
         // Exclude files starting with "." unless optionA is set. 
         if ((entry->d_name[0] == '.' && !opts.optionA)) {
             continue;
         }
 
-        char fullPath[PATH_MAX];
-        snprintf(fullPath, PATH_MAX, "%s/%s", directory, entry->d_name);
-        
         struct stat statbuf;
-        if (stat(fullPath, &statbuf) == -1) {
-            perror("Error getting file info");
+        if (fstatat(dirfd(dir), entry->d_name, &statbuf, 0) == -1) {
+            logErrno("Error getting file info");
             continue;
         }
 
         if (S_ISREG(statbuf.st_mode)) {
             if (opts.optionO) {
                 for (int i = 0; i < opts.numConsiderPatterns; i++) {
-                    if (matchesRegex(opts.considerPatterns[i], entry->d_name)) {
+                    if (matchesPattern(opts.considerRegexes, opts.considerPatterns, i, entry->d_name)) {
                         closedir(dir);
                         return true; // Found a matching file
                     }
@@ -103,7 +139,10 @@ bool directoryContainsMatchingFiles(const char* directory, ProgramOptions opts)
             }
         } else if (S_ISDIR(statbuf.st_mode) && opts.optionR) {
             // Recursively check subdirectories
-            if (directoryContainsMatchingFiles(fullPath, opts)) {
+            char* fullPath = fsioJoinPath(directory, entry->d_name);
+            bool found = fullPath != NULL && directoryContainsMatchingFiles(fullPath, opts);
+            free(fullPath);
+            if (found) {
                 closedir(dir);
                 return true; // Found a matching file in a subdirectory
             }
@@ -114,24 +153,63 @@ bool directoryContainsMatchingFiles(const char* directory, ProgramOptions opts)
     return false; // No matching files found
 }
 
-// A function that returns the timestamp of a file at a given path
-time_t getTimestamp(const char* filePath) {
+// A function that returns the timestamp of a file at a given path (to the nanosecond)
+struct timespec getTimestamp(const char* filePath) {
     struct stat fileStat;
 
-    if (stat(filePath, &fileStat) == 0) {
-        return fileStat.st_mtime; // Modification timestamp
+    if (fsioStat(filePath, &fileStat) == 0) {
+        return fileStat.st_mtim; // Modification timestamp
     }
 
     // If the stat operation fails, return a default timestamp (current time)
-    return time(NULL);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now;
 }
 
+// Helper function to check a filename against the ignore (-i) and match (-o) patterns
+static int fileIsSelected(const char* name, ProgramOptions opts) {
+    // IF IGNORE FLAG (-i):
+    // IF IGNORE_PATTERNS matches name -> not selected
+    if (opts.optionI) {
+        for (int i = 0; i < opts.numIgnorePatterns; i++) {
+            if (matchesPattern(opts.ignoreRegexes, opts.ignorePatterns, i, name)) {
+                if (opts.optionV) {
+                    logMessage(LOG_LEVEL_VERBOSE, "Ignoring file %s due to matching pattern: %s\n", name, opts.ignorePatterns[i]);
+                }
+                return 0;
+            }
+        }
+    }
+    // IF MATCH FLAG (-o):
+    // IF MATCH_PATTERN does NOT match name -> not selected
+    if (opts.optionO) {
+        for (int i = 0; i < opts.numConsiderPatterns; i++) {
+            if (matchesPattern(opts.considerRegexes, opts.considerPatterns, i, name)) {
+                if (opts.optionV) {
+                    logMessage(LOG_LEVEL_VERBOSE, "Selecting file %s due to matching pattern: %s\n", name, opts.considerPatterns[i]);
+                }
+                return 1;
+            }
+        }
+        return 0;
+    }
+    return 1;
+}
+
+// A regular file read from a directory, waiting to be matched against the patterns
+typedef struct {
+    char* name;
+    struct stat info;
+    int selected;
+} FoundFile;
+
 // Function that returns the content to be synced between directories
 SyncedContent* readFiles(char** directories, int numDirectories, ProgramOptions opts) {
     SyncedContent* content = (SyncedContent*)malloc(sizeof(SyncedContent));
 
     if (content == NULL) {
-        perror("Memory allocation error");
+        logErrno("Memory allocation error");
         return NULL;
     }
 
@@ -140,23 +218,33 @@ SyncedContent* readFiles(char** directories, int numDirectories, ProgramOptions
 
     content->directories = NULL;
     content->numDirectories = 0;
-    if(opts.optionV){printf("=== Reading Directories ===\n");}
+    if(opts.optionV){logMessage(LOG_LEVEL_VERBOSE, "=== Reading Directories ===\n");}
     for (int i = 0; i < numDirectories; i++) {
         const char* path = directories[i];
-        DIR* dir = opendir(path);
+        TRACE_BEGIN("scan", path);
+        DIR* dir = fsioOpenDir(path);
 
         if (dir == NULL) {
-            fprintf(stderr, "Error opening directory: %s\n", path);
+            logMessage(LOG_LEVEL_ERROR, "Error opening directory: %s\n", path);
+            TRACE_END("scan", path);
             continue;
         }
 
-        if(opts.optionV){printf("Reading Directory: %s\n", path);}
+        if(opts.optionV){logMessage(LOG_LEVEL_VERBOSE, "Reading Directory: %s\n", path);}
 
+        FoundFile* found = NULL;
+        int numFound = 0;
+        int maxFound = 0;
         struct dirent* entry;
         while ((entry = readdir(dir)) != NULL) {
             //Ignore [.] and [..] outright
             if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 || strcmp(entry->d_name, ".DS_Store") == 0){
                 continue;}
+
+            // Never sync our own partial / checkpoint files
+            if (isResumeArtifact(entry->d_name)) {
+                continue;
+            }
             
             // Exclude files starting with "." unless optionA is set. 
             if ((entry->d_name[0] == '.' && !opts.optionA)) {
@@ -164,17 +252,15 @@ SyncedContent* readFiles(char** directories, int numDirectories, ProgramOptions
             }
                 
                    
-            char fullPath[PATH_MAX];
-            snprintf(fullPath, PATH_MAX, "%s/%s", path, entry->d_name);
-
+            // Stat relative to the open directory rather than rebuilding the full path
             struct stat statbuf;
-            if (stat(fullPath, &statbuf) == -1) {
-                perror("Error getting file info");
+            if (fstatat(dirfd(dir), entry->d_name, &statbuf, 0) == -1) {
+                logErrno("Error getting file info");
                 continue;
             }
 
             if (S_ISDIR(statbuf.st_mode)) {
-                if(opts.optionV){printf("Found (SUB)directory: %s\n", entry->d_name);}
+                if(opts.optionV){logMessage(LOG_LEVEL_VERBOSE, "Found (SUB)directory: %s\n", entry->d_name);}
                 // Handle subdirectories
 
                 // Check if the directory already exists in the array
@@ -190,14 +276,14 @@ SyncedContent* readFiles(char** directories, int numDirectories, ProgramOptions
                     // Directory doesn't exist in the array, so add it
                     DirInfo dirInfo;
                     dirInfo.name = strdup(entry->d_name);
-                    dirInfo.timestamp = statbuf.st_mtime;
+                    dirInfo.timestamp = statbuf.st_mtim;
                     dirInfo.permissions = statbuf.st_mode; // Store the directory permissions
-                    dirInfo.path = strdup(fullPath);
+                    dirInfo.path = fsioJoinPath(path, entry->d_name);
 
                     // Increase the size of the directories array
                     DirInfo* temp = (DirInfo*)realloc(content->directories, (content->numDirectories + 1) * sizeof(DirInfo));
                     if (temp == NULL) {
-                        perror("Memory allocation error");
+                        logErrno("Memory allocation error");
                         free(dirInfo.name);
                         free(dirInfo.path);
                         break;
@@ -208,199 +294,263 @@ SyncedContent* readFiles(char** directories, int numDirectories, ProgramOptions
                     content->numDirectories++;
                 } else {
                     // Directory with the same name already exists, replace it if more recent
-                    if (statbuf.st_mtime > content->directories[existingDirIndex].timestamp) {
+                    if (compareTimestamps(statbuf.st_mtim, content->directories[existingDirIndex].timestamp) > 0) {
                         free(content->directories[existingDirIndex].name);
                         free(content->directories[existingDirIndex].path);
                         content->directories[existingDirIndex].name = strdup(entry->d_name);
-                        content->directories[existingDirIndex].timestamp = statbuf.st_mtime;
+                        content->directories[existingDirIndex].timestamp = statbuf.st_mtim;
                         content->directories[existingDirIndex].permissions = statbuf.st_mode;
-                        content->directories[existingDirIndex].path = strdup(fullPath);
+                        content->directories[existingDirIndex].path = fsioJoinPath(path, entry->d_name);
                     }
                 }
             } else if (S_ISREG(statbuf.st_mode)) {
-                if(opts.optionV){printf("Found file: %s\n", entry->d_name);}
-                // Handle regular files
-
-                // IF IGNORE FLAG (-i):
-                // IF IGNORE_PATTERNS matches entry->d_name -> continue;
-                if (opts.optionI) {
-                    int shouldIgnore = 0;
-                    for (int i = 0; i < opts.numIgnorePatterns; i++) {
-                        if (matchesRegex(opts.ignorePatterns[i],entry->d_name)) {
-                            shouldIgnore = 1;
-                            if (opts.optionV) {
-                                printf("Ignoring file %s due to matching pattern: %s\n", entry->d_name, opts.ignorePatterns[i]);
-                            }
-                            break;
-                        }
+                if(opts.optionV){logMessage(LOG_LEVEL_VERBOSE, "Found file: %s\n", entry->d_name);}
+                // Handle regular files once the whole directory has been read
+                if (numFound == maxFound) {
+                    maxFound = maxFound > 0 ? maxFound * 2 : 64;
+                    FoundFile* temp = (FoundFile*)realloc(found, maxFound * sizeof(FoundFile));
+                    if (temp == NULL) {
+                        logErrno("Memory allocation error");
+                        break;
                     }
-                    if (shouldIgnore) continue;
+                    found = temp;
                 }
-                // IF MATCH FLAG (-o):
-                // IF MATCH_PATTERN does NOT match entry->d_name -> continue;
-                if (opts.optionO) {
-                    int shouldConsider = 0;
-                    for (int i = 0; i < opts.numConsiderPatterns; i++) {
-                        if (matchesRegex(opts.considerPatterns[i], entry->d_name)) {
-                            shouldConsider = 1;
-                            if (opts.optionV) {
-                                printf("Selecting file %s due to matching pattern: %s\n", entry->d_name, opts.considerPatterns[i]);
-                            }
-                            break;
-                        }
-                    }
-                    if (!shouldConsider) continue;
+                found[numFound].name = strdup(entry->d_name);
+                found[numFound].info = statbuf;
+                if (found[numFound].name != NULL) {
+                    numFound++;
                 }
+            }
+        }
 
+        closedir(dir);
+        TRACE_END("scan", path);
 
-                // Check if the file already exists in the array
-                int existingFileIndex = -1;
-                for (int j = 0; j < content->numFiles; j++) {
-                    if (strcmp(content->files[j].name, entry->d_name) == 0) {
-                        existingFileIndex = j;
-                        break;
-                    }
-                }
+        // Check the directory's files against the ignore (-i) / match (-o) patterns as
+        // one batch, so the timeline shows matching apart from reading the directory
+        TRACE_BEGIN("match", path);
+        for (int k = 0; k < numFound; k++) {
+            found[k].selected = fileIsSelected(found[k].name, opts);
+        }
+        TRACE_END("match", path);
 
-                if (existingFileIndex == -1) {
-                    // File doesn't exist in the array, so add it
-                    FileInfo fileInfo;
-                    fileInfo.name = strdup(entry->d_name);
-                    fileInfo.timestamp = statbuf.st_mtime;
-                    fileInfo.permissions = statbuf.st_mode; // Store the file permissions
-                    fileInfo.path = strdup(fullPath);
+        for (int k = 0; k < numFound; k++) {
+            if (!found[k].selected) {
+                continue;
+            }
 
-                    // Increase the size of the files array
-                    FileInfo* temp = (FileInfo*)realloc(content->files, (content->numFiles + 1) * sizeof(FileInfo));
-                    if (temp == NULL) {
-                        perror("Memory allocation error");
-                        free(fileInfo.name);
-                        free(fileInfo.path);
-                        break;
-                    }
+            // Check if the file already exists in the array
+            int existingFileIndex = -1;
+            for (int j = 0; j < content->numFiles; j++) {
+                if (strcmp(content->files[j].name, found[k].name) == 0) {
+                    existingFileIndex = j;
+                    break;
+                }
+            }
 
-                    content->files = temp;
-                    content->files[content->numFiles] = fileInfo;
-                    content->numFiles++;
-                } else {
-                    // File with the same name already exists, replace it if more recent
-                    if (statbuf.st_mtime > content->files[existingFileIndex].timestamp) {
-                        free(content->files[existingFileIndex].name);
-                        free(content->files[existingFileIndex].path);
-                        content->files[existingFileIndex].name = strdup(entry->d_name);
-                        content->files[existingFileIndex].timestamp = statbuf.st_mtime;
-                        content->files[existingFileIndex].permissions = statbuf.st_mode;
-                        content->files[existingFileIndex].path = strdup(fullPath);
-                    }
+            if (existingFileIndex == -1) {
+                // File doesn't exist in the array, so add it
+                FileInfo fileInfo;
+                fileInfo.name = strdup(found[k].name);
+                fileInfo.timestamp = found[k].info.st_mtim;
+                fileInfo.permissions = found[k].info.st_mode; // Store the file permissions
+                fileInfo.path = fsioJoinPath(path, found[k].name);
+                fileInfo.size = found[k].info.st_size;
+                fileInfo.device = found[k].info.st_dev;
+                fileInfo.inode = found[k].info.st_ino;
+
+                // Increase the size of the files array
+                FileInfo* temp = (FileInfo*)realloc(content->files, (content->numFiles + 1) * sizeof(FileInfo));
+                if (temp == NULL) {
+                    logErrno("Memory allocation error");
+                    free(fileInfo.name);
+                    free(fileInfo.path);
+                    break;
+                }
+
+                content->files = temp;
+                content->files[content->numFiles] = fileInfo;
+                content->numFiles++;
+            } else {
+                // File with the same name already exists, replace it if more recent
+                if (compareTimestamps(found[k].info.st_mtim, content->files[existingFileIndex].timestamp) > 0) {
+                    free(content->files[existingFileIndex].name);
+                    free(content->files[existingFileIndex].path);
+                    content->files[existingFileIndex].name = strdup(found[k].name);
+                    content->files[existingFileIndex].timestamp = found[k].info.st_mtim;
+                    content->files[existingFileIndex].permissions = found[k].info.st_mode;
+                    content->files[existingFileIndex].path = fsioJoinPath(path, found[k].name);
+                    content->files[existingFileIndex].size = found[k].info.st_size;
+                    content->files[existingFileIndex].device = found[k].info.st_dev;
+                    content->files[existingFileIndex].inode = found[k].info.st_ino;
                 }
             }
         }
-
-        closedir(dir);
-        if(opts.optionV){printf("\n");}
+        for (int k = 0; k < numFound; k++) {
+            free(found[k].name);
+        }
+        free(found);
+        if(opts.optionV){logMessage(LOG_LEVEL_VERBOSE, "\n");}
     }
     
     return content;
 }
 
+// Function to free the content returned by readFiles
+void freeSyncedContent(SyncedContent* content) {
+    if (content == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < content->numFiles; i++) {
+        free(content->files[i].name);
+        free(content->files[i].path);
+    }
+    for (int i = 0; i < content->numDirectories; i++) {
+        free(content->directories[i].name);
+        free(content->directories[i].path);
+    }
+    free(content->files);
+    free(content->directories);
+    free(content);
+}
+
 // Function to print debug information about the content to be synced
 void debugPrintSyncedContent(SyncedContent* content) {
     if (content->numFiles == 0 && content->numDirectories == 0) {
-        printf("No synced content found.\n");
+        logMessage(LOG_LEVEL_VERBOSE, "No synced content found.\n");
         return;
     }
 
-    printf("=== Items To Sync (Most Recent) ===\n");
+    logMessage(LOG_LEVEL_VERBOSE, "=== Items To Sync (Most Recent) ===\n");
 
-    printf("Files:\n");
+    logMessage(LOG_LEVEL_VERBOSE, "Files:\n");
     for (int i = 0; i < content->numFiles; i++) {
-        printf("%s (Timestamp: %ld, Permissions: %o)\n",
-               content->files[i].path, content->files[i].timestamp,
+        logMessage(LOG_LEVEL_VERBOSE, "%s (Timestamp: %lld.%09ld, Permissions: %o)\n",
+               content->files[i].path, (long long)content->files[i].timestamp.tv_sec, content->files[i].timestamp.tv_nsec,
                content->files[i].permissions);
     }
-    printf("\n");
-    printf("Directories:\n");
+    logMessage(LOG_LEVEL_VERBOSE, "\n");
+    logMessage(LOG_LEVEL_VERBOSE, "Directories:\n");
     for (int i = 0; i < content->numDirectories; i++) {
-        printf("%s (Timestamp: %ld, Permissions: %o)\n",
-               content->directories[i].path, content->directories[i].timestamp,
+        logMessage(LOG_LEVEL_VERBOSE, "%s (Timestamp: %lld.%09ld, Permissions: %o)\n",
+               content->directories[i].path, (long long)content->directories[i].timestamp.tv_sec, content->directories[i].timestamp.tv_nsec,
                content->directories[i].permissions);
     }
-    printf("\n");
+    logMessage(LOG_LEVEL_VERBOSE, "\n");
 }
 
-// Function to copy a file from source to destination while preserving metadata
-int copyFileWithMetadata(const char* sourcePath, const char* destinationPath) {
-    // Open the source file for reading
-    int sourceFile = open(sourcePath, O_RDONLY);
-    if (sourceFile == -1) {
-        perror("Error opening source file");
+// Function to apply the source's permissions and timestamps to an open destination
+int applyMetadata(int destinationFd, const struct stat* sourceInfo, const char* destinationPath) {
+    TRACE_BEGIN("metadata", destinationPath);
+
+    // Set the destination's metadata to match the source
+    if (fchmod(destinationFd, sourceInfo->st_mode & 07777) == -1) {
+        logErrno("Error setting destination permissions");
+        TRACE_END("metadata", destinationPath);
         return 1;
     }
 
-    // Create or open the destination file for writing
-    int destinationFile = open(destinationPath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    if (destinationFile == -1) {
-        perror("Error opening destination file");
-        close(sourceFile);
-        return 1;
+    struct timespec times[2];
+    times[0] = sourceInfo->st_atim;
+    times[1] = sourceInfo->st_mtim;
+    if (futimens(destinationFd, times) == -1) {
+        logErrno("Error setting file timestamp");
     }
 
-    // Define a buffer to read and write data
-    char buffer[1024];
-    ssize_t bytesRead;
+    TRACE_END("metadata", destinationPath);
+    return 0;
+}
 
-    // Copy data from the source file to the destination file
-    while ((bytesRead = read(sourceFile, buffer, sizeof(buffer))) > 0) {
-        if (write(destinationFile, buffer, bytesRead) == -1) {
-            perror("Error writing to destination file");
-            close(sourceFile);
-            close(destinationFile);
-            return 1;
-        }
+// Function to give an open destination only the source's modification time. Copies keep
+// it without -p too, so on the next run a copy doesn't look newer than its source.
+int applyModificationTime(int destinationFd, const struct stat* sourceInfo) {
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1] = sourceInfo->st_mtim;
+    if (futimens(destinationFd, times) == -1) {
+        logErrno("Error setting file timestamp");
     }
+    return 0;
+}
 
-    // Close the files
-    close(sourceFile);
-    close(destinationFile);
-
-    // Retrieve the source file's metadata
+// Helper function to apply a source directory's permissions and timestamps to another directory
+static int copyDirectoryMetadata(const char* sourcePath, const char* destinationPath) {
+    // Retrieve the source directory's metadata
     struct stat sourceInfo;
-    if (stat(sourcePath, &sourceInfo) == -1) {
-        perror("Error getting source file metadata");
+    if (fsioStat(sourcePath, &sourceInfo) == -1) {
+        logErrno("Error getting source file metadata");
         return 1;
     }
 
-    // Set the destination file's metadata to match the source
-    if (chmod(destinationPath, sourceInfo.st_mode) == -1) {
-        perror("Error setting destination file permissions");
+    FsioEntry* entry;
+    int destinationFd = fsioDirFd(destinationPath, &entry);
+    if (destinationFd == -1) {
+        logErrno("Error opening destination directory");
         return 1;
     }
 
-    struct utimbuf ut;
-    ut.actime = sourceInfo.st_atime;
-    ut.modtime = sourceInfo.st_mtime;
+    int result = applyMetadata(destinationFd, &sourceInfo, destinationPath);
+    fsioReleaseDirFd(destinationFd, entry);
+    return result;
+}
 
-    if (utime(destinationPath, &ut) == -1) {
-    perror("Error setting file timestamp");
+// Function to make a destination directory with default permissions, then the source
+// directory's metadata if -p is set (1 if that can't be applied)
+int makeDestinationDirectory(const char* path, const char* sourcePath, ProgramOptions opts) {
+    TRACE_BEGIN("mkdir", path);
+    if (fsioMkdir(path, 0777) != 0) {
+        logErrno("Error creating directory");
     }
+    TRACE_END("mkdir", path);
 
-
+    // Preserve metadata if -p is set
+    if (opts.optionP && copyDirectoryMetadata(sourcePath, path) != 0) {
+        return 1;
+    }
     return 0;
 }
 
-// Function to copy a file from source to destination without preserving metadata
-int copyFileWithoutMetadata(const char* sourcePath, const char* destinationPath) {
+// Function to create or truncate a destination file for writing. A destination sharing its
+// data with other names (e.g. a moved file linked by -m) is unlinked first, so rewriting it
+// can't change the other names.
+int openDestinationFile(const char* destinationPath) {
+    struct stat destinationInfo;
+    if (fsioStat(destinationPath, &destinationInfo) == 0 && S_ISREG(destinationInfo.st_mode) && destinationInfo.st_nlink > 1) {
+        fsioUnlink(destinationPath);
+    }
+
+    return fsioOpen(destinationPath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+}
+
+// Helper function to copy the bytes (and optionally metadata) of a file from source to destination
+static int copyFileContents(const char* sourcePath, const char* destinationPath, ProgramOptions opts, int preserveMetadata) {
     // Open the source file for reading
-    int sourceFile = open(sourcePath, O_RDONLY);
+    int sourceFile = fsioOpen(sourcePath, O_RDONLY, 0);
     if (sourceFile == -1) {
-        perror("Error opening source file");
+        logErrno("Error opening source file");
         return 1;
     }
 
+    struct stat sourceInfo;
+    if (fstat(sourceFile, &sourceInfo) == -1) {
+        logErrno("Error getting source file metadata");
+        close(sourceFile);
+        return 1;
+    }
+
+    // Large files are copied through a checkpointed partial file if -c is set
+    if (opts.optionC && sourceInfo.st_size >= RESUME_MIN_SIZE) {
+        int result = copyFileResumable(sourceFile, &sourceInfo, destinationPath, opts.optionH, preserveMetadata);
+        close(sourceFile);
+        return result;
+    }
+
     // Create or open the destination file for writing
-    int destinationFile = open(destinationPath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    int destinationFile = openDestinationFile(destinationPath);
     if (destinationFile == -1) {
-        perror("Error opening destination file");
+        logErrno("Error opening destination file");
         close(sourceFile);
         return 1;
     }
@@ -411,68 +561,106 @@ int copyFileWithoutMetadata(const char* sourcePath, const char* destinationPath)
 
     // Copy data from the source file to the destination file
     while ((bytesRead = read(sourceFile, buffer, sizeof(buffer))) > 0) {
+        BUDGET_CONSUME(bytesRead);
         if (write(destinationFile, buffer, bytesRead) == -1) {
-            perror("Error writing to destination file");
+            logErrno("Error writing to destination file");
             close(sourceFile);
             close(destinationFile);
             return 1;
         }
     }
 
+    // Set metadata through the open descriptor, before closing
+    int result = 0;
+    if (preserveMetadata) {
+        result = applyMetadata(destinationFile, &sourceInfo, destinationPath);
+    } else {
+        result = applyModificationTime(destinationFile, &sourceInfo);
+    }
+
     // Close the files
     close(sourceFile);
     close(destinationFile);
 
-    return 0;
+    return result;
+}
+
+// Function to copy a file from source to destination while preserving metadata
+int copyFileWithMetadata(const char* sourcePath, const char* destinationPath, ProgramOptions opts) {
+    TRACE_BEGIN("copy", destinationPath);
+    int result = copyFileContents(sourcePath, destinationPath, opts, 1);
+    TRACE_END("copy", destinationPath);
+    return result;
+}
+
+// Function to copy a file from source to destination without preserving metadata
+int copyFileWithoutMetadata(const char* sourcePath, const char* destinationPath, ProgramOptions opts) {
+    TRACE_BEGIN("copy", destinationPath);
+    int result = copyFileContents(sourcePath, destinationPath, opts, 0);
+    TRACE_END("copy", destinationPath);
+    return result;
 }
 
 // Function to create the destination path
 char* createDestinationPath(const char* directory, const char* filename) {
-    char* destinationPath = (char*)malloc(PATH_MAX);
-
-    if (destinationPath == NULL) {
-        perror("Memory allocation error");
-        return NULL;
-    }
+    return fsioJoinPath(directory, filename);
+}
 
-    if (snprintf(destinationPath, PATH_MAX, "%s/%s", directory, filename) >= PATH_MAX) {
-        fprintf(stderr, "Destination path exceeds PATH_MAX\n");
-        free(destinationPath);
-        return NULL;
+// Function to find which of roots a path lies in (the longest, for nested roots), or -1
+int findPathRoot(const char* path, char** roots, int numRoots) {
+    int best = -1;
+    size_t bestLength = 0;
+    for (int i = 0; i < numRoots; i++) {
+        const char* root = roots[i];
+        size_t length = strlen(root);
+        if (strncmp(path, root, length) == 0 && (path[length] == '/' || (length > 0 && root[length - 1] == '/'))
+            && (best == -1 || length > bestLength)) {
+            best = i;
+            bestLength = length;
+        }
     }
+    return best;
+}
 
-    return destinationPath;
+// Function returning a monotonic time in seconds, for measuring durations
+double monotonicSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-// The main function to sync the selected content, with given options, on given directories
-int syncFiles(SyncedContent* content, ProgramOptions opts) {
+// Helper function to plan the copies for the selected content, recursing into subdirectories.
+// Subdirectories are still created here, as they must exist before they can be read.
+static int planSync(SyncedContent* content, ProgramOptions opts, SyncPlan* plan, MoveIndex* moves) {
     int i, j;
-    if (opts.optionN) {printf("=== Not Syncing ===\n");}
-    if (!opts.optionN && opts.optionV) {printf("=== Syncing ===\n");}
+    if (opts.optionN) {logMessage(LOG_LEVEL_VERBOSE, "=== Not Syncing ===\n");}
+    if (!opts.optionN && opts.optionV) {logMessage(LOG_LEVEL_VERBOSE, "=== Syncing ===\n");}
     // Iterate through each directory specified in ProgramOptions
     for (i = 0; i < opts.numDirectories; i++) {
         const char* directory = opts.directories[i];
-        if (opts.optionV) {printf("Syncing directory: %s\n", directory);}
+        if (opts.optionV) {logMessage(LOG_LEVEL_VERBOSE, "Syncing directory: %s\n", directory);}
+        long long window = modifyWindow(directory, opts);
 
         // Iterate through each unique/most recent file in SyncedContent
         for (j = 0; j < content->numFiles; j++) {
             FileInfo sourceFile = content->files[j];
-            const char* destinationFilePath = createDestinationPath(directory, sourceFile.name);
+            char* destinationFilePath = createDestinationPath(directory, sourceFile.name);
+            if (destinationFilePath == NULL) {
+                continue;
+            }
 
             // If the file already exists in the directory
             if (validatePath(destinationFilePath) == 2) {
 
-                // If the file is outdated 
-                if (sourceFile.timestamp > getTimestamp(destinationFilePath)) {
-                    if (!opts.optionN) {
-                        if (opts.optionP) {
-                            copyFileWithMetadata(sourceFile.path, destinationFilePath);
-                        } else {
-                            copyFileWithoutMetadata(sourceFile.path, destinationFilePath);
-                        }
+                // If the file is outdated (planned with -n too, for the estimate, but not performed)
+                if (timestampNewer(sourceFile.timestamp, getTimestamp(destinationFilePath), window)) {
+                    if (addCopyOperation(plan, sourceFile.path, destinationFilePath, 1,
+                                         sourceFile.size, sourceFile.device, sourceFile.inode, NULL) != 0) {
+                        free(destinationFilePath);
+                        return 1;
                     }
                     // Print syncing (updating) output
-                    printf("Syncing %s to %s\n", sourceFile.path, directory);
+                    logMessage(LOG_LEVEL_INFO, "Syncing %s to %s\n", sourceFile.path, directory);
                 } else {
 
                     // Skip the file if it's not newer
@@ -481,57 +669,55 @@ int syncFiles(SyncedContent* content, ProgramOptions opts) {
                     }
                 }
             } else {
-                // File doesn't exist, create it and copy the source file
-                if (!opts.optionN) {
-                    if (opts.optionP) {
-                        copyFileWithMetadata(sourceFile.path, destinationFilePath);
-                    } else {
-                        copyFileWithoutMetadata(sourceFile.path, destinationFilePath);
-                    }
+                // File doesn't exist, look for it elsewhere in this root in case it was moved (-m)
+                char* linkSource = findMoveCandidate(moves, &sourceFile, destinationFilePath, opts);
+
+                // Create it and copy the source file (or link the moved file)
+                if (addCopyOperation(plan, sourceFile.path, destinationFilePath, 0,
+                                     sourceFile.size, sourceFile.device, sourceFile.inode, linkSource) != 0) {
+                    free(linkSource);
+                    free(destinationFilePath);
+                    return 1;
                 }
                 // Print syncing (copying) output
-                if (opts.optionV) {printf("Copying %s to %s\n", sourceFile.path, directory);}
+                if (linkSource != NULL) {
+                    if (opts.optionV) {logMessage(LOG_LEVEL_VERBOSE, "Linking %s to %s (moved)\n", linkSource, destinationFilePath);}
+                } else {
+                    if (opts.optionV) {logMessage(LOG_LEVEL_VERBOSE, "Copying %s to %s\n", sourceFile.path, directory);}
+                }
+                free(linkSource);
             }
 
-            
+            free(destinationFilePath);
         }
-        if (opts.optionV) {printf("\n");}
+        if (opts.optionV) {logMessage(LOG_LEVEL_VERBOSE, "\n");}
+    }
+
+    // This directory is decided, its copies can start while subdirectories are planned
+    if (flushSyncPlan(plan) != 0) {
+        return 1;
     }
 
     // Handle subdirectories if -r is set
     if (opts.optionR && content->numDirectories > 0) {
-        if (opts.optionV) {printf("=== Recursing ===\n");}
+        if (opts.optionV) {logMessage(LOG_LEVEL_VERBOSE, "=== Recursing ===\n");}
 
         // For each subdirectory
         for (i = 0; i < content->numDirectories; i++) {
-            char* subDirectoryPath = createDestinationPath(opts.directories[i], content->directories[i].name);
-    
-            // Add this check:
-            if (!directoryContainsMatchingFiles(subDirectoryPath, opts)) {
+            // Add this check (against the most recent copy of the subdirectory):
+            if (!directoryContainsMatchingFiles(content->directories[i].path, opts)) {
                 // This directory (or its subdirectories) doesn't contain any matching files
                 // So we skip syncing it
                 continue;
             }
 
-            ProgramOptions newOpts;
-            newOpts.optionA = opts.optionA; 
-            newOpts.optionN = opts.optionN;
-            newOpts.optionP = opts.optionP;
-            newOpts.optionR = opts.optionR;
-            newOpts.optionV = opts.optionV;
-            newOpts.optionI = opts.optionI;
-            newOpts.optionO = opts.optionO;
-            newOpts.ignorePatterns = opts.ignorePatterns;
-            newOpts.considerPatterns = opts.considerPatterns;
-            newOpts.numIgnorePatterns = opts.numIgnorePatterns;
-            newOpts.numConsiderPatterns = opts.numConsiderPatterns;
-
+            ProgramOptions newOpts = opts;
             newOpts.numDirectories = 1;
             newOpts.directories = malloc(sizeof(char*));
             newOpts.directories[0] = content->directories[i].path;
 
             const char* subDirectoryName = content->directories[i].name;
-            if (opts.optionV) {printf("Syncing Subdirectory: %s\n\n", content->directories[i].path);}
+            if (opts.optionV) {logMessage(LOG_LEVEL_VERBOSE, "Syncing Subdirectory: %s\n\n", content->directories[i].path);}
             // For each parent directory
             for (j = 0; j < opts.numDirectories; j++) {
                 const char* destinationDirectory = opts.directories[j];
@@ -541,43 +727,16 @@ int syncFiles(SyncedContent* content, ProgramOptions opts) {
 
                 int subDirType = validatePath(subDirectoryPath);
 
-                // If the subdirectory doesn't exist, create it
+                // If the subdirectory doesn't exist, create it (a dry run never does, and a
+                // plan that may not be executed leaves it to executeSyncPlan)
                 if(subDirType == 0){
-                    if (!opts.optionN){
-                            // Make the subdirectory with default permissions
-                            if (mkdir(subDirectoryPath, 0777) != 0) {
-                                perror("Error creating directory");
-                            }
-                            
-                            // Preserve metadata if -p is set
-                            if (opts.optionP){
-            
-                                // Get source file info
-                                struct stat sourceInfo;
-                                if (stat(content->directories[i].path, &sourceInfo) == -1) {
-                                    perror("Error getting source file metadata");
-                                    return 1;
-                                }
-
-                                // Set the directory permissions to match the source
-                                if (chmod(subDirectoryPath, sourceInfo.st_mode) == -1) {
-                                    perror("Error setting destination directory permissions");
-                                    return 1;
-                                }
-
-                                struct utimbuf ut;
-                                ut.actime = sourceInfo.st_atime;
-                                ut.modtime = sourceInfo.st_mtime;
-
-                                // Set the directory timestamp to match the source
-                                if (utime(subDirectoryPath, &ut) == -1) {
-                                    perror("Error setting file timestamp");
-                                }
-
-                        }
+                    addDirectoryOperation(plan, subDirectoryPath, content->directories[i].path);
+                    if (!opts.optionN && !plan->deferDirectories
+                        && makeDestinationDirectory(subDirectoryPath, content->directories[i].path, opts) != 0){
+                        return 1;
                     }
                                                 
-                    if (opts.optionV) {printf("Could not find %s. Making Directory.\n", subDirectoryPath);}
+                    if (opts.optionV) {logMessage(LOG_LEVEL_VERBOSE, "Could not find %s. Making Directory.\n", subDirectoryPath);}
                     
                     // Add the new subdirectory to newOpts
                     newOpts.numDirectories++;
@@ -586,7 +745,8 @@ int syncFiles(SyncedContent* content, ProgramOptions opts) {
                 }
 
                 // Already exists (but is outdated)
-                if(subDirType == 1 && content->directories[i].timestamp > getTimestamp(subDirectoryPath)){
+                if(subDirType == 1 && timestampNewer(content->directories[i].timestamp, getTimestamp(subDirectoryPath),
+                                                     modifyWindow(destinationDirectory, opts))){
                     // Add the new subdirectory to newOpts
                     newOpts.numDirectories++;
                     newOpts.directories = realloc(newOpts.directories, newOpts.numDirectories * sizeof(char*));
@@ -594,22 +754,43 @@ int syncFiles(SyncedContent* content, ProgramOptions opts) {
                 }
 
                 if(subDirType == 2){
-                    if (opts.optionV) {printf("Error: %s is a file, could not make a directory\n", subDirectoryPath);}
+                    if (opts.optionV) {logMessage(LOG_LEVEL_VERBOSE, "Error: %s is a file, could not make a directory\n", subDirectoryPath);}
                 }
+
+                free(subDirectoryPath);
             }
 
             // Debug message to print the subdirectories
             if(opts.optionV){
-                printf("=== Subdirectories to be Synced ===\n");
+                logMessage(LOG_LEVEL_VERBOSE, "=== Subdirectories to be Synced ===\n");
                 for (int i = 0; i < newOpts.numDirectories; i++) {
-                    printf("%s\n", newOpts.directories[i]);
+                    logMessage(LOG_LEVEL_VERBOSE, "%s\n", newOpts.directories[i]);
                 }
             }
-            // Call readFiles with updated opts to get the content of subdirectories
-            SyncedContent* subdirContent = readFiles(newOpts.directories, newOpts.numDirectories, newOpts);
+            // Call readFiles with updated opts to get the content of subdirectories (those
+            // not made yet have nothing to read)
+            char** readable = malloc(newOpts.numDirectories * sizeof(char*));
+            int numReadable = 0;
+            for (j = 0; readable != NULL && j < newOpts.numDirectories; j++) {
+                if (j == 0 || validatePath(newOpts.directories[j]) == 1) {
+                    readable[numReadable++] = newOpts.directories[j];
+                }
+            }
+            SyncedContent* subdirContent = readable ? readFiles(readable, numReadable, newOpts) : NULL;
+            free(readable);
 
-            // Call syncFiles to synchronize the subdirectories
-            syncFiles(subdirContent, newOpts);
+            // Plan the synchronisation of the subdirectories
+            int result = subdirContent ? planSync(subdirContent, newOpts, plan, moves) : 1;
+
+            freeSyncedContent(subdirContent);
+            for (j = 1; j < newOpts.numDirectories; j++) {
+                free(newOpts.directories[j]);
+            }
+            free(newOpts.directories);
+
+            if (result != 0) {
+                return 1;
+            }
 
         }
 
@@ -621,24 +802,58 @@ int syncFiles(SyncedContent* content, ProgramOptions opts) {
 }
 
 
+// Function to plan the copies needed to sync the selected content (without performing them)
+int planSyncFiles(SyncedContent* content, ProgramOptions opts, SyncPlan* plan) {
+    // Moved files are found by searching each destination root (-m)
+    MoveIndex* moves = opts.optionM ? createMoveIndex(opts.directories, opts.numDirectories) : NULL;
+
+    int result = planSync(content, opts, plan, moves);
+
+    freeMoveIndex(moves);
+    return result;
+}
+
+// The main function to sync the selected content, with given options, on given directories
+int syncFiles(SyncedContent* content, ProgramOptions opts) {
+    SyncPlan* plan = createSyncPlan();
+    if (plan == NULL) {
+        return 1;
+    }
+
+    int result = planSyncFiles(content, opts, plan);
+
+    // Order the pending copies before performing them (a dry run only plans them)
+    if (result == 0 && !opts.optionN) {
+        if (opts.optionS) {
+            orderSyncPlan(plan, opts.copyOrder);
+        }
+        if (executeSyncPlan(plan, opts, NULL) != 0) {
+            result = 1;
+        }
+    }
+
+    freeSyncPlan(plan);
+    return result;
+}
+
 // Function to print debug information about pattern matching / ignoring
 void debugPrintRegexPatterns(ProgramOptions opts) {
-    printf("=== Regex Patterns ===\n");
+    logMessage(LOG_LEVEL_VERBOSE, "=== Regex Patterns ===\n");
 
     if (opts.optionI && opts.numIgnorePatterns > 0) {
-        printf("=== Ignore Patterns ===\n");
+        logMessage(LOG_LEVEL_VERBOSE, "=== Ignore Patterns ===\n");
         for (int i = 0; i < opts.numIgnorePatterns; i++) {
-            printf("Regex -> %s\n", opts.ignorePatterns[i]);
+            logMessage(LOG_LEVEL_VERBOSE, "Regex -> %s\n", opts.ignorePatterns[i]);
         }
-        printf("\n");
+        logMessage(LOG_LEVEL_VERBOSE, "\n");
     }
 
     if (opts.optionO && opts.numConsiderPatterns > 0) {
-        printf("=== Match Patterns ===\n");
+        logMessage(LOG_LEVEL_VERBOSE, "=== Match Patterns ===\n");
         for (int i = 0; i < opts.numConsiderPatterns; i++) {
-            printf("Regex -> %s\n", opts.considerPatterns[i]);
+            logMessage(LOG_LEVEL_VERBOSE, "Regex -> %s\n", opts.considerPatterns[i]);
         }
-        printf("\n");
+        logMessage(LOG_LEVEL_VERBOSE, "\n");
     }
 }
 
@@ -649,7 +864,7 @@ int matchesRegex(const char *pattern, const char *string) {
     
     ret = regcomp(&regex, pattern, REG_NOSUB | REG_EXTENDED);
     if (ret) {
-        perror("Could not compile regex");
+        logErrno("Could not compile regex");
         exit(EXIT_FAILURE); // Compilation failed, treat as no match
     }
     
@@ -661,7 +876,75 @@ int matchesRegex(const char *pattern, const char *string) {
     } else if (ret == REG_NOMATCH) {
         return 0; // No match
     } else {
-        fprintf(stderr, "Regex match failed for pattern: %s\n", pattern); //No file has sequence
+        logMessage(LOG_LEVEL_ERROR, "Regex match failed for pattern: %s\n", pattern); //No file has sequence
         exit(EXIT_FAILURE);
     }
-}
\ No newline at end of file
+}
+// Helper function to compile numPatterns patterns into a new array (NULL on failure, with
+// the patterns compiled so far freed)
+static regex_t* compilePatternList(char** patterns, int numPatterns) {
+    regex_t* compiled = (regex_t*)malloc(numPatterns * sizeof(regex_t));
+    if (compiled == NULL) {
+        logErrno("Memory allocation error");
+        return NULL;
+    }
+
+    for (int i = 0; i < numPatterns; i++) {
+        if (regcomp(&compiled[i], patterns[i], REG_NOSUB | REG_EXTENDED) != 0) {
+            logMessage(LOG_LEVEL_ERROR, "Could not compile regex: %s\n", patterns[i]);
+            // Only the first i were compiled
+            for (int j = 0; j < i; j++) {
+                regfree(&compiled[j]);
+            }
+            free(compiled);
+            return NULL;
+        }
+    }
+    return compiled;
+}
+
+// Function to compile the ignore / match patterns once (0 on success). On failure no
+// patterns are left compiled.
+int compilePatterns(ProgramOptions* opts) {
+    if (opts->ignoreRegexes == NULL && opts->numIgnorePatterns > 0) {
+        opts->ignoreRegexes = compilePatternList(opts->ignorePatterns, opts->numIgnorePatterns);
+        if (opts->ignoreRegexes == NULL) {
+            return 1;
+        }
+    }
+
+    if (opts->considerRegexes == NULL && opts->numConsiderPatterns > 0) {
+        opts->considerRegexes = compilePatternList(opts->considerPatterns, opts->numConsiderPatterns);
+        if (opts->considerRegexes == NULL) {
+            freePatterns(opts);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Function to free the compiled patterns
+void freePatterns(ProgramOptions* opts) {
+    if (opts->ignoreRegexes != NULL) {
+        for (int i = 0; i < opts->numIgnorePatterns; i++) {
+            regfree(&opts->ignoreRegexes[i]);
+        }
+        free(opts->ignoreRegexes);
+        opts->ignoreRegexes = NULL;
+    }
+    if (opts->considerRegexes != NULL) {
+        for (int i = 0; i < opts->numConsiderPatterns; i++) {
+            regfree(&opts->considerRegexes[i]);
+        }
+        free(opts->considerRegexes);
+        opts->considerRegexes = NULL;
+    }
+}
+
+// Helper function to match pattern i, using its compiled form when there is one
+int matchesPattern(const regex_t* compiled, char** patterns, int i, const char* string) {
+    if (compiled != NULL) {
+        return regexec(&compiled[i], string, 0, NULL, 0) == 0;
+    }
+    return matchesRegex(patterns[i], string);
+}
@@ -1,21 +1,26 @@
 #ifndef UTILITY_H
 #define UTILITY_H
 #include "options.h"
+#include "plan.h"
 #include <limits.h>
 #include <time.h>
 #include <stdbool.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 
 typedef struct {
     char* name;      
-    time_t timestamp; 
+    struct timespec timestamp; // Modification time, to the nanosecond
     mode_t permissions; 
     char* path;      
+    off_t size;
+    dev_t device;
+    ino_t inode;
 } FileInfo;
 
 typedef struct {
     char* name;      
-    time_t timestamp;
+    struct timespec timestamp;
     mode_t permissions; 
     char* path;      
 } DirInfo;
@@ -34,18 +39,34 @@ void debugPrintOptions(ProgramOptions opts);
 
 int validatePath(const char* path);
 
-time_t getTimestamp(const char* filePath);
+struct timespec getTimestamp(const char* filePath);
 
 SyncedContent* readFiles(char** directories, int numDirectories, ProgramOptions opts);
 
+void freeSyncedContent(SyncedContent* content);
+
 void debugPrintSyncedContent(SyncedContent* content);
 
-int copyFileWithMetadata(const char* sourcePath, const char* destinationPath);
+int applyMetadata(int destinationFd, const struct stat* sourceInfo, const char* destinationPath);
+
+int applyModificationTime(int destinationFd, const struct stat* sourceInfo);
+
+int makeDestinationDirectory(const char* path, const char* sourcePath, ProgramOptions opts);
 
-int copyFileWithoutMetadata(const char* sourcePath, const char* destinationPath);
+int openDestinationFile(const char* destinationPath);
+
+int copyFileWithMetadata(const char* sourcePath, const char* destinationPath, ProgramOptions opts);
+
+int copyFileWithoutMetadata(const char* sourcePath, const char* destinationPath, ProgramOptions opts);
 
 char* createDestinationPath(const char* directory, const char* filename);
 
+int findPathRoot(const char* path, char** roots, int numRoots);
+
+double monotonicSeconds();
+
+int planSyncFiles(SyncedContent* content, ProgramOptions opts, SyncPlan* plan);
+
 int syncFiles(SyncedContent* content, ProgramOptions opts);
 
 char *glob2regex(char *glob);
@@ -54,6 +75,12 @@ void debugPrintRegexPatterns(ProgramOptions opts);
 
 int matchesRegex(const char *pattern, const char *string);
 
+int compilePatterns(ProgramOptions* opts);
+
+void freePatterns(ProgramOptions* opts);
+
+int matchesPattern(const regex_t* compiled, char** patterns, int i, const char* string);
+
 bool directoryContainsMatchingFiles(const char* directory, ProgramOptions opts);
 
 #endif